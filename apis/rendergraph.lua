@@ -28,6 +28,17 @@ local sp = rg.Step
 rg.State = {doc = "A certain State in which Steps may execute."}
 local st = rg.State
 
+rg.type.Counts = compound{
+	v0_1_3 = {
+		{'dependencies', index},
+		{'barriers', index},
+		{'implied', index},
+		{'sets', index},
+		{'unsets', index},
+		{'recorded', index},
+	}
+}
+
 rg.type.Dependency = compound{
 	v0_1_1 = {
 		{'step', sp},
@@ -75,11 +86,38 @@ sp.v0_1_1.addDependencies = {
 	{'dependencies', array{rg.Dependency}},
 }
 
+sp.v0_1_1.removeStep = {
+	doc = [[
+		Remove the Step from the Graph and free it. Each Dependency other
+		Steps have on it is replaced by ones on the Steps it depended on
+		(with their source stages and accesses, and its own destination
+		ones), so they are still kept after everything that came before
+		it. If `setCache` was used, the Step's cached CommandBuffer is
+		freed with it, so it must not be pending.
+	]],
+}
+
 rg.v0_1_1.compile = {
 	doc = [[
-		Get the VkRenderPass from the Graph. <spass> is called with
-		the Steps and subpass-bound States for a single subpass, and
-		should return the resulting SubpassDescription.
+		Get the VkRenderPass from the Graph. Steps that share a
+		subpass-bound State are put in the same subpass, and Steps with
+		none that come one after another (in the order of `getSteps`)
+		share one of their own. If the subpasses would depend on each
+		other in a cycle, the ones in (and after) it are merged into one.
+		<spass> is called for each subpass in order, with the <udata>'s of
+		its Steps and subpass-bound States, and should return the
+		resulting SubpassDescription; anything it points to must last
+		until this returns. Attachments used before and after a subpass
+		that doesn't use them are added to its preserve list, unless
+		<spass> gave one. Dependencies between subpasses become part of the
+		RenderPass, the ones within a subpass are recorded as barriers.
+		Dependencies that are implied by a chain of others (with stages
+		and accesses that cover it) are left out of both, though only
+		short chains through nearby Steps are looked for. Everything
+		`record` does is worked out here as well, ahead of time.
+		If the Graph already made a RenderPass from the same
+		attachments, subpasses and dependencies, and it's still around
+		(see `keepRenderPasses`), that one is returned again.
 	]],
 	returns = {vk.Device.RenderPass, vk.Vk.Result},
 	{'dev', vk.Device}, {'attachments', array{vk.Vk.AttachmentDescription}},
@@ -100,7 +138,11 @@ rg.v0_1_1.getStates = {
 
 rg.v0_1_1.getSteps = {
 	doc = [[
-		Get a list of all the <udata>'s for all the Steps in the Graph.
+		Get a list of all the <udata>'s for all the Steps in the Graph,
+		in the order they will be recorded in. Steps that don't depend
+		on each other are put together when they use the same States,
+		and otherwise in the order that changes the fewest States,
+		falling back on the order they were added in.
 	]],
 	returns = {array{sp}},
 }
@@ -112,6 +154,8 @@ rg.v0_1_1.record = {
 		<cmd> for recording Steps.
 		<attachments> is the array of attachments used when creating the
 		Framebuffer, for attachment-based dependencies.
+		If the Graph has changed since it was compiled, what to record
+		is worked out again first (but the RenderPass stays the same).
 	]],
 	{'cb', vk.CommandBuffer}, {'rpbi', vk.Vk.RenderPassBeginInfo},
 	{'attachments', array{vk.Device.Image}},
@@ -119,3 +163,75 @@ rg.v0_1_1.record = {
 	{'uset', callable{{'state', st}}},
 	{'cmd', callable{{'step', sp}}},
 }
+
+rg.v0_1_3.getCounts = {
+	doc = [[
+		Get how many Dependencies the last `record` had to honor within
+		its subpasses, and how many pipeline barriers it took to do so.
+		The Dependencies of a Step are merged into one barrier, and ones
+		already covered by an earlier barrier in the subpass are dropped.
+		<implied> is how many Dependencies were left out entirely for
+		being implied by others, the last time the Steps were sorted.
+		<sets> and <unsets> are how many State transitions the last
+		`record` made. <recorded> is how many Steps it had to record,
+		which is all of them unless `setCache` was used. With `setCache`,
+		<sets> only counts the States set by the Steps it recorded, and
+		<unsets> is always 0, since those never unset anything. This
+		belongs to the Graph.
+	]],
+	returns = {rg.Counts},
+}
+
+rg.v0_1_3.setCache = {
+	doc = [[
+		Have `record` keep the commands of each Step in its own
+		secondary CommandBuffer, allocated from a pool on <dev> for
+		queue family <family>. These are only recorded again when the
+		Step was marked dirty, the RenderPass changed, or the images
+		its barriers use changed; the rest are executed as they are.
+		Each one starts with the Step's barrier and sets all of its
+		States, so <uset> isn't used. Only for Graphs where every Step
+		was added as secondary. The caller must make sure none of them
+		are pending when they would be recorded again.
+	]],
+	returns = {vk.Vk.Result},
+	{'dev', vk.Device}, {'family', index},
+}
+
+rg.v0_1_3.setParallel = {
+	doc = [[
+		Have `record` cut the Steps into chunks that each stay within a
+		subpass, and record every chunk into its own secondary
+		CommandBuffer on at most <threads> threads (0 for one per core).
+		They are then executed in order from the CommandBuffer given to
+		`record`. Each chunk gets a CommandPool on <dev> for queue
+		family <family>, and is reset by the next `record`, so that must
+		not happen while the last one is pending. Each chunk starts by
+		setting all the States of its first Step, and ends by unsetting
+		the ones of its last. <set>, <uset> and <cmd> are called from
+		many threads at once, though never for the same CommandBuffer.
+		Only for Graphs where every Step was added as secondary, and
+		`setCache` takes precedence over this.
+	]],
+	returns = {vk.Vk.Result},
+	{'dev', vk.Device}, {'family', index}, {'threads', index},
+}
+
+rg.v0_1_3.keepRenderPasses = {
+	doc = [[
+		Keep the RenderPasses that `compile` replaced until <frames>
+		`record`s have been made without them, so that the frames in
+		flight can finish with them, and so `compile` can return them
+		again if it comes back to the same one. With 0 (the default),
+		they're destroyed as soon as they are replaced. They all go
+		when the Graph is destroyed.
+	]],
+	{'frames', index},
+}
+
+sp.v0_1_3.markDirty = {
+	doc = [[
+		Mark the Step to be recorded again by the next `record`, when
+		its commands have changed.
+	]],
+}
@@ -24,6 +24,28 @@ ShaderBank = {doc = [[
 local sb = ShaderBank
 
 sb.Component = {doc = [[A shader that has been loaded into a Bank.]]}
+sb.Pending = {doc = [[A construct that is running in the background.]]}
+sb.Watch = {doc = [[A construct that is redone when its files change.]]}
+
+sb.type.Binding = compound{
+	v0_1_3 = {
+		{'set', index},
+		{'binding', index},
+		{'type', vk.Vk.DescriptorType},
+		{'count', index},
+		{'stages', vk.Vk.ShaderStageFlags},
+	}
+}
+
+sb.type.Reflection = compound{
+	v0_1_3 = {
+		{'stages', vk.Vk.ShaderStageFlags},
+		{'bindings', array{sb.Binding}},
+		{'pushConstantSize', index},
+		{'inputs', array{index}},
+		{'workgroupSize', vk.Vk.Extent3D},
+	}
+}
 
 sb.v0_1_2.load = {
 	doc = [[
@@ -33,6 +55,72 @@ sb.v0_1_2.load = {
 	returns = {sb.Component}, {'smci', vk.Vk.ShaderModuleCreateInfo},
 }
 
+sb.v0_1_3.borrow = {
+	doc = [[
+		Load a shader into the Bank without copying its code. The memory
+		pointed to by <smci>'s pCode must remain valid and unchanged until
+		the Component is unloaded for the last time. If the same code was
+		already loaded from elsewhere, it is copied after all, so other
+		loads never depend on this memory. May return NULL if something
+		goes wrong.
+	]],
+	returns = {sb.Component}, {'smci', vk.Vk.ShaderModuleCreateInfo},
+}
+
+sb.v0_1_3.loadFile = {
+	doc = [[
+		Load a shader into the Bank from a SPIR-V file at <path>. The file
+		is mapped read-only into memory rather than copied, and the mapping
+		is kept until the Component is unloaded for the last time. Loading
+		the same <path> again returns the same Component, but it is never
+		shared with other files or with `load` and `borrow`, even if the
+		code is the same, since a Watch may reload it. May return NULL if
+		something goes wrong.
+	]],
+	returns = {sb.Component}, {'path', string},
+}
+
+sb.v0_1_3.setOptimization = {
+	doc = [[
+		Set how much effort later constructs put into shrinking the shaders
+		they make. At <level> 0 the merged code is used as-is. At 1 any
+		Functions, variables, types and decorations that the "main" EPs
+		can't reach are removed, and the <id>s are renumbered so the bound
+		is as small as possible. At 2 the debug info (names, strings, source
+		and line info) is removed as well. Defaults to 0.
+	]],
+	{'level', index},
+}
+
+sb.v0_1_3.setCompression = {
+	doc = [[
+		Set whether Components loaded from now on are kept in a packed form,
+		which is usually a fair bit smaller than the SPIR-V itself. Packed
+		Components are unpacked whenever they are used in a construct, which
+		makes constructs somewhat slower. Defaults to false.
+	]],
+	{'enable', boolean},
+}
+
+sb.v0_1_3.getCodeSize = {
+	doc = [[
+		Get the number of bytes of code the Bank is holding for its
+		Components, and in <original> the number of bytes that code would
+		take up as plain SPIR-V.
+	]],
+	returns = {index, index},
+}
+
+sb.v0_1_3.unload = {
+	doc = [[
+		Give up a Component returned by one of the loads. Loading code that
+		is identical to an already loaded Component returns that Component
+		again, so the Component is only freed once it has been unloaded as
+		many times as it was loaded. It must not be in use by a construct.
+	]],
+	{'component', sb.Component},
+}
+
 sb.v0_1_2.construct = {
 	doc = [[
 		Construct a new shader that cumulates the effects of the previously
@@ -68,3 +156,157 @@ sb.v0_1_2.construct = {
 	returns = {vk.Device.ShaderModule, vk.Vk.Result},
 	{'dev', vk.Device}, {'components', array{sb.Component}},
 }
+
+sb.v0_1_3.constructBatch = {
+	doc = [[
+		Construct many shaders at once, as if `construct` was called for
+		each entry of <components> in turn. The work is spread across at
+		most <threads> threads (0 for one per core), and the resulting
+		ShaderModules are returned in the same order as <components>.
+		Entries that fail are VK_NULL_HANDLE, and the first failure is
+		returned as the Result. The Bank must not be loaded into while
+		this is running.
+	]],
+	returns = {array{vk.Device.ShaderModule}, vk.Vk.Result},
+	{'dev', vk.Device}, {'components', array{array{sb.Component}}},
+	{'threads', index},
+}
+
+sb.v0_1_3.constructSpecialized = {
+	doc = [[
+		Like `construct`, but the specialization constants are replaced
+		with normal constants, using the values in <spec> or their defaults
+		if <spec> doesn't have them. Any OpSpecConstantOps on integer or
+		boolean scalars are worked out as well, so the result is a shader
+		that doesn't need any specialization info when it's used.
+	]],
+	returns = {vk.Device.ShaderModule, vk.Vk.Result},
+	{'dev', vk.Device}, {'components', array{sb.Component}},
+	{'spec', vk.Vk.SpecializationInfo},
+}
+
+sb.v0_1_3.reflect = {
+	doc = [[
+		Get the interface of a Component: the stages it has EPs for, the
+		descriptors it binds (by set and binding), the size of its push
+		constant block, the Locations of its vertex inputs and the
+		workgroup size of its compute EP (0 if it has none). This is worked
+		out when the Component is loaded, and belongs to the Bank. When
+		`pollWatches` reloads the Component the same Reflection is updated
+		in place, though the arrays it points to may move.
+	]],
+	returns = {sb.Reflection}, {'component', sb.Component},
+}
+
+sb.v0_1_3.reflectConstruct = {
+	doc = [[
+		Get the interface of the shader that `construct` would make from
+		<components>, in the same form as `reflect`. The result must be
+		freed with `destroyReflection`. May return NULL if the Components
+		can't be merged.
+	]],
+	returns = {sb.Reflection}, {'components', array{sb.Component}},
+}
+
+sb.v0_1_3.destroyReflection = {
+	doc = [[Free a Reflection returned by `reflectConstruct`.]],
+	{'reflection', sb.Reflection},
+}
+
+sb.v0_1_3.constructCode = {
+	doc = [[
+		Build the SPIR-V that `constructSpecialized` would make a ShaderModule
+		from, and return it instead, along with its size in bytes. <spec> may
+		be NULL to leave the specialization constants alone. No Device is
+		needed. The result must be freed with `destroyCode`. May return NULL
+		if the Components can't be merged.
+	]],
+	returns = {memory, index},
+	{'components', array{sb.Component}},
+	{'spec', vk.Vk.SpecializationInfo},
+}
+
+sb.v0_1_3.destroyCode = {
+	doc = [[Free the code returned by `constructCode`.]],
+	{'code', memory},
+}
+
+sb.v0_1_3.constructComponent = {
+	doc = [[
+		Merge <components> as `construct` would, but load the result into
+		the Bank as a new Component instead of making a ShaderModule. This
+		lets shaders that share a prefix of Components be built up one
+		Component at a time: constructing from the result and one more
+		Component only merges the two, rather than every Component over
+		again. The EMs chosen for the merge are kept as they are, and the
+		result gets "compat_" EPs listing every other EM all of
+		<components> could run under, so merging it further works
+		whenever merging all the Components at once would. No
+		specialization or optimization is done until the final construct.
+		The result should be unloaded like any other Component. May return
+		NULL if the Components can't be merged.
+	]],
+	returns = {sb.Component}, {'components', array{sb.Component}},
+}
+
+sb.v0_1_3.constructAsync = {
+	doc = [[
+		Start a `construct` of <components> on the Bank's worker threads,
+		and return right away. The result is picked up with
+		`finishConstruct`, which must be called exactly once for every
+		Pending. If <done> is given it is called on the worker once the
+		result is ready, with the same ShaderModule and Result.
+	]],
+	returns = {sb.Pending},
+	{'dev', vk.Device}, {'components', array{sb.Component}},
+	{'done', callable{
+		{'module', vk.Device.ShaderModule}, {'result', vk.Vk.Result},
+	}},
+}
+
+sb.v0_1_3.finishConstruct = {
+	doc = [[
+		Get the result of a `constructAsync`, and free the Pending. If
+		<wait> is false and the construct hasn't finished yet, this returns
+		VK_NOT_READY and the Pending stays valid.
+	]],
+	returns = {vk.Device.ShaderModule, vk.Vk.Result},
+	{'pending', sb.Pending}, {'wait', boolean},
+}
+
+sb.v0_1_3.watch = {
+	doc = [[
+		Construct <components> as `construct` would, and keep doing so
+		whenever one of the files they were loaded from (with `loadFile`)
+		changes. If <done> is given it gets the ShaderModule right away,
+		and then again from `pollWatches` every time it is rebuilt; the old
+		ShaderModules are the caller's to destroy. Watched Components must
+		stay loaded until the Watch is gone. Components that
+		`constructComponent` made out of file-backed ones (at any depth)
+		can't be rebuilt this way, so watching one returns NULL.
+	]],
+	returns = {sb.Watch},
+	{'dev', vk.Device}, {'components', array{sb.Component}},
+	{'done', callable{
+		{'module', vk.Device.ShaderModule}, {'result', vk.Vk.Result},
+	}},
+}
+
+sb.v0_1_3.unwatch = {
+	doc = [[Stop rebuilding a Watch, and free it.]],
+	{'watch', sb.Watch},
+}
+
+sb.v0_1_3.pollWatches = {
+	doc = [[
+		Check for changes to the files of watched Components. Every changed
+		file is loaded again (in place, so the Component stays the same),
+		and then only the Watches that use one of them are rebuilt, on the
+		Bank's worker threads. Their <done>s are called from this thread
+		before it returns. Files that no longer hold valid SPIR-V are
+		skipped. If <wait> is true this blocks until something changes.
+		Returns the number of Watches that were rebuilt. Constructs must
+		not be running on the Bank while this is.
+	]],
+	returns = {index}, {'wait', boolean},
+}
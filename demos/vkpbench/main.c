@@ -0,0 +1,373 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include <vivacious/vivacious.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define Vv_CHOICE V
+Vv V;
+
+// This demo times how long RenderGraphs take to build, compile and record.
+// It needs a Device, but no window: the Graphs render into plain Images, and
+// the command buffers are never submitted. The Steps and States record
+// nothing themselves, so what's timed is the Graph's own work.
+
+#define WIDTH 256
+#define HEIGHT 256
+#define NATTACH 4
+
+static void error(const char* what, VkResult r) {
+	fprintf(stderr, "Error %s: %d!\n", what, r);
+	exit(1);
+}
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+static uint64_t seed = 88172645463325252ull;
+static uint64_t rnd() {
+	seed ^= seed << 13;
+	seed ^= seed >> 7;
+	seed ^= seed << 17;
+	return seed;
+}
+
+// Everything a Graph needs to be recorded.
+static struct {
+	VkDevice dev;
+	uint32_t family;
+	VkCommandPool pool;
+	VkCommandBuffer cb;
+	VkImage imgs[NATTACH];
+	VkImageView views[NATTACH];
+} ctx;
+
+// The subpass-bound States say what their subpass looks like, the rest just
+// use the first attachment.
+typedef struct {
+	int bound;
+	VkSubpassDescription sd;
+} Bind;
+static const VkAttachmentReference color0 = {
+	0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+};
+static size_t spasses;	// How many subpasses the last compile made
+static VkSubpassDescription spass(void* ud, size_t nsps, void** sps,
+	size_t nsts, void** sts) {
+	spasses++;
+	if(nsts > 0) return ((Bind*)sts[0])->sd;
+	return (VkSubpassDescription){
+		.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+		.colorAttachmentCount = 1, .pColorAttachments = &color0,
+	};
+}
+
+// These do nothing, so they're safe to call from many threads at once.
+static void set(void* ud, void* st, VkCommandBuffer cb) {}
+static void uset(void* ud, void* st, VkCommandBuffer cb) {}
+static void cmd(void* ud, void* sp, VkCommandBuffer cb) {}
+
+#define DEP(S, ...) (VvVkP_Dependency){ .step = (S), \
+	.srcStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, \
+	.dstStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, \
+	.srcAccess = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, \
+	.dstAccess = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT, __VA_ARGS__ }
+
+// A Step that depends on up to 3 of the 16 Steps before it, in one subpass.
+static void addChain(VvVkP_Graph* g, VvVkP_Step** sps, size_t n,
+	VvVkP_State** sts, size_t nsts) {
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Dependency ds[3];
+		VvVkP_Dependency* dps[3];
+		size_t dc = i ? rnd() % 4 : 0;
+		for(size_t j=0; j < dc; j++) {
+			ds[j] = DEP(sps[i - 1 - rnd() % (i < 16 ? i : 16)]);
+			dps[j] = &ds[j];
+		}
+		sps[i] = vVvkp_addStep(g, NULL, 1, 1, &sts[rnd() % nsts], dc, dps);
+	}
+}
+
+// A Graph like a deferred renderer: each layer draws into its own
+// attachment, and reads the one before as an input attachment.
+static const VkAttachmentReference colors[NATTACH] = {
+	{0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+	{1, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+	{2, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+	{3, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL},
+};
+static const VkAttachmentReference inputs[NATTACH] = {
+	{0, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+	{1, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+	{2, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+	{3, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL},
+};
+static Bind layers[NATTACH];
+// The first Step depends on <before>, if there is one.
+static void addLayersAfter(VvVkP_Graph* g, VvVkP_Step** sps, size_t n,
+	VvVkP_State** sts, size_t nsts, VvVkP_Step* before) {
+	VvVkP_State* ls[NATTACH];
+	for(int l=0; l < NATTACH; l++) {
+		layers[l] = (Bind){1, {
+			.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS,
+			.inputAttachmentCount = l > 0 ? 1 : 0,
+			.pInputAttachments = l > 0 ? &inputs[l-1] : NULL,
+			.colorAttachmentCount = 1, .pColorAttachments = &colors[l],
+		}};
+		ls[l] = vVvkp_addState(g, &layers[l], 1);
+	}
+	size_t per = n / NATTACH;
+	for(size_t i=0; i < n; i++) {
+		int l = i / per < NATTACH ? i / per : NATTACH-1;
+		size_t start = l*per;
+		VvVkP_Dependency ds[3];
+		VvVkP_Dependency* dps[3];
+		size_t dc = 0;
+		if(i == start && l > 0)	// The whole of the last layer
+			ds[dc++] = DEP(sps[i-1], .dstStage =
+				VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+				.dstAccess = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+		else if(i == 0 && before)
+			ds[dc++] = DEP(before);
+		else if(i > start) {
+			dc = 1 + rnd() % 2;
+			for(size_t j=0; j < dc; j++)
+				ds[j] = DEP(sps[i - 1 - rnd() % (i-start < 16 ? i-start : 16)]);
+			if(i % 8 == 0)	// Some read back what the layer drew so far
+				ds[0] = DEP(ds[0].step, .attachmentEnable = 1,
+					.attachment = l, .attachmentRange = {
+						VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1,
+					}, .flags = VK_DEPENDENCY_BY_REGION_BIT);
+		}
+		for(size_t j=0; j < dc; j++) dps[j] = &ds[j];
+		VvVkP_State* ss[2] = {ls[l], sts[rnd() % nsts]};
+		sps[i] = vVvkp_addStep(g, NULL, 1, 2, ss, dc, dps);
+	}
+}
+static void addLayers(VvVkP_Graph* g, VvVkP_Step** sps, size_t n,
+	VvVkP_State** sts, size_t nsts) {
+	addLayersAfter(g, sps, n, sts, nsts, NULL);
+}
+
+// The layers again, between a clear and a post-process that aren't bound to
+// a subpass, the way vkhelp does it. They should get subpasses of their own.
+static void addFramed(VvVkP_Graph* g, VvVkP_Step** sps, size_t n,
+	VvVkP_State** sts, size_t nsts) {
+	sps[0] = vVvkp_addStep(g, NULL, 1, 1, &sts[0], 0, NULL);
+	addLayersAfter(g, &sps[1], n-2, sts, nsts, sps[0]);
+	VvVkP_Dependency d = DEP(sps[n-2], .dstStage =
+		VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+		.dstAccess = VK_ACCESS_INPUT_ATTACHMENT_READ_BIT);
+	sps[n-1] = vVvkp_addStep(g, NULL, 1, 1, &sts[0], 1,
+		(VvVkP_Dependency*[]){&d});
+}
+
+// Every Step depends on the first (a clear, say) and on the one before it,
+// so all but one of the dependencies on the first are implied.
+static void addFanout(VvVkP_Graph* g, VvVkP_Step** sps, size_t n,
+	VvVkP_State** sts, size_t nsts) {
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Dependency ds[2];
+		VvVkP_Dependency* dps[2];
+		size_t dc = 0;
+		if(i > 0) ds[dc++] = DEP(sps[0]);
+		if(i > 1) ds[dc++] = DEP(sps[i-1]);
+		for(size_t j=0; j < dc; j++) dps[j] = &ds[j];
+		sps[i] = vVvkp_addStep(g, NULL, 1, 1, &sts[rnd() % nsts], dc, dps);
+	}
+}
+
+// With CACHED, each Step keeps its own CommandBuffer and 1 in 20 of them
+// change between records. With PARALLEL, chunks of Steps are recorded on
+// every core.
+enum { PLAIN, CACHED, PARALLEL };
+static void bench(const char* name, size_t n, int mode,
+	void (*add)(VvVkP_Graph*, VvVkP_Step**, size_t, VvVkP_State**, size_t)) {
+
+	VvVkP_Graph* g = vVvkp_create();
+	Bind plain = {0};
+	VvVkP_State* sts[8];
+	for(int i=0; i < 8; i++) sts[i] = vVvkp_addState(g, &plain, 0);
+	VvVkP_Step** sps = malloc(n*sizeof(VvVkP_Step*));
+	double built = now();
+	add(g, sps, n, sts, 8);
+	built = now() - built;
+
+	VkAttachmentDescription ads[NATTACH];
+	for(int i=0; i < NATTACH; i++) ads[i] = (VkAttachmentDescription){
+		.format = VK_FORMAT_R8G8B8A8_UNORM,
+		.samples = VK_SAMPLE_COUNT_1_BIT,
+		.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR,
+		.storeOp = VK_ATTACHMENT_STORE_OP_STORE,
+		.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL,
+	};
+	VkResult r;
+	spasses = 0;
+	double compiled = now();
+	VkRenderPass rpass = vVvkp_getRenderPass(g, ctx.dev, NATTACH, ads,
+		spass, NULL, &r);
+	compiled = now() - compiled;
+	if(!rpass) error("getting the RenderPass", r);
+	VkFramebuffer fb;
+	r = vVvk_CreateFramebuffer(ctx.dev, &(VkFramebufferCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO,
+		.renderPass = rpass,
+		.attachmentCount = NATTACH, .pAttachments = ctx.views,
+		.width = WIDTH, .height = HEIGHT, .layers = 1,
+	}, NULL, &fb);
+	if(r < 0) error("creating the Framebuffer", r);
+
+	VkClearValue clears[NATTACH] = {{{{0}}}};
+	VkRenderPassBeginInfo rpbi = {
+		.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO,
+		.renderPass = rpass, .framebuffer = fb,
+		.renderArea = {{0,0}, {WIDTH, HEIGHT}},
+		.clearValueCount = NATTACH, .pClearValues = clears,
+	};
+	if(mode == CACHED) {
+		VkResult r = vVvkp_setCache(g, ctx.dev, ctx.family);
+		if(r < 0) error("setting up the cache", r);
+	} else if(mode == PARALLEL) {
+		VkResult r = vVvkp_setParallel(g, ctx.dev, ctx.family, 0);
+		if(r < 0) error("setting up the workers", r);
+	}
+	long cnt = 0;
+	double start = now(), t;
+	do {
+		vVvk_ResetCommandPool(ctx.dev, ctx.pool, 0);
+		if(mode == CACHED) for(size_t i=0; i < n/20; i++)
+			vVvkp_markDirty(g, sps[rnd() % n]);
+		vVvk_BeginCommandBuffer(ctx.cb, &(VkCommandBufferBeginInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		});
+		vVvkp_record(g, ctx.cb, &rpbi, ctx.imgs, set, NULL, uset, NULL,
+			cmd, NULL);
+		vVvk_EndCommandBuffer(ctx.cb);
+		cnt++;
+	} while((t = now() - start) < 2e8);
+
+	const VvVkP_Counts* c = vVvkp_getCounts(g);
+	printf("%-10s %6zu steps: %10.0f ns, %6.1f ns/step (build %.0f us, "
+		"compile %.0f us)\n", name, n, t/cnt, t/cnt/n, built/1e3,
+		compiled/1e3);
+	printf("%18s %zu subpasses, %zu barriers for %zu dependencies "
+		"(%zu implied), %zu sets, %zu unsets, %zu recorded\n", "", spasses,
+		c->barriers, c->dependencies, c->implied, c->sets, c->unsets,
+		c->recorded);
+
+	vVvk_DestroyFramebuffer(ctx.dev, fb, NULL);
+	vVvkp_destroy(g);
+	free(sps);
+}
+
+int main() {
+	V = vV();
+
+	// The Instance and Device, nothing fancy
+	vVvk_load();
+	VkInstance inst;
+	VkResult r = vVvkb_createInstance(&VvVkB_InstInfo(
+		.name = "RenderGraph Benchmark", .version = 0,
+	), &inst);
+	if(r < 0) error("creating the Instance", r);
+	vVvk_loadInst(inst, 0);
+	VkPhysicalDevice pdev;
+	VvVkB_QueueSpec qs;
+	r = vVvkb_createDevice(&VvVkB_DevInfo(
+		Vv_ARRAY(tasks, (VvVkB_TaskInfo[]){
+			{.flags=VK_QUEUE_GRAPHICS_BIT},
+		}),
+	), inst, &ctx.dev, &pdev, &qs);
+	if(r < 0) error("creating the Device", r);
+	vVvk_loadDev(ctx.dev, 1);
+	ctx.family = qs.family;
+
+	// The attachments, which are never actually drawn to
+	VvVkM_Pool* pool = vVvkm_create(pdev, ctx.dev);
+	for(int i=0; i < NATTACH; i++) {
+		r = vVvk_CreateImage(ctx.dev, &(VkImageCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+			.imageType = VK_IMAGE_TYPE_2D,
+			.format = VK_FORMAT_R8G8B8A8_UNORM,
+			.extent = {WIDTH, HEIGHT, 1},
+			.mipLevels = 1, .arrayLayers = 1,
+			.samples = VK_SAMPLE_COUNT_1_BIT,
+			.tiling = VK_IMAGE_TILING_OPTIMAL,
+			.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+				| VK_IMAGE_USAGE_INPUT_ATTACHMENT_BIT,
+			.sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+			.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+		}, NULL, &ctx.imgs[i]);
+		if(r < 0) error("creating an Image", r);
+		vVvkm_registerImage(pool, ctx.imgs[i],
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, 0);
+	}
+	r = vVvkm_bind(pool);
+	if(r < 0) error("binding memory", r);
+	for(int i=0; i < NATTACH; i++) {
+		r = vVvk_CreateImageView(ctx.dev, &(VkImageViewCreateInfo){
+			.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+			.image = ctx.imgs[i],
+			.viewType = VK_IMAGE_VIEW_TYPE_2D,
+			.format = VK_FORMAT_R8G8B8A8_UNORM,
+			.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0,1, 0,1},
+		}, NULL, &ctx.views[i]);
+		if(r < 0) error("creating an ImageView", r);
+	}
+
+	r = vVvk_CreateCommandPool(ctx.dev, &(VkCommandPoolCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+		.queueFamilyIndex = ctx.family,
+	}, NULL, &ctx.pool);
+	if(r < 0) error("creating the CommandPool", r);
+	r = vVvk_AllocateCommandBuffers(ctx.dev, &(VkCommandBufferAllocateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		.commandPool = ctx.pool,
+		.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		.commandBufferCount = 1,
+	}, &ctx.cb);
+	if(r < 0) error("allocating the CommandBuffer", r);
+
+	size_t sizes[] = {100, 1000, 10000};
+	for(int i=0; i < 3; i++) bench("chain", sizes[i], PLAIN, addChain);
+	for(int i=0; i < 3; i++) bench("layers", sizes[i], PLAIN, addLayers);
+	for(int i=0; i < 3; i++) bench("framed", sizes[i], PLAIN, addFramed);
+	for(int i=0; i < 3; i++) bench("fanout", sizes[i], PLAIN, addFanout);
+	for(int i=0; i < 3; i++) bench("chain/c", sizes[i], CACHED, addChain);
+	for(int i=0; i < 3; i++) bench("layers/c", sizes[i], CACHED, addLayers);
+	for(int i=0; i < 3; i++) bench("chain/p", sizes[i], PARALLEL, addChain);
+	for(int i=0; i < 3; i++) bench("layers/p", sizes[i], PARALLEL, addLayers);
+
+	vVvk_DestroyCommandPool(ctx.dev, ctx.pool, NULL);
+	for(int i=0; i < NATTACH; i++) {
+		vVvk_DestroyImageView(ctx.dev, ctx.views[i], NULL);
+		vVvkm_destroyImage(pool, ctx.imgs[i]);
+	}
+	vVvkm_destroy(pool);
+	vVvk_DestroyDevice(ctx.dev, NULL);
+	vVvk_DestroyInstance(inst, NULL);
+	vVvk_unload();
+	return 0;
+}
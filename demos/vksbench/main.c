@@ -0,0 +1,475 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include <vivacious/vivacious.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define Vv_CHOICE V
+Vv V;
+
+// This demo doesn't need a window, and only wants a Device for timing
+// constructBatch: everything else goes through constructCode, so it runs
+// anywhere the library builds. It has two modes:
+//   bench: time the merge on the corpus, and print the numbers.
+//   fuzz [N]: mutate the corpus N times, loading and merging each mutant.
+// A mutant that crashes is left in fuzz-current.spv, and one that takes far
+// longer per word than the corpus does (over several runs, so a busy machine
+// doesn't count) is saved as fuzz-slow-<i>.spv.
+
+// The bits of SPIR-V the generated shaders need, from the spec.
+enum {
+	OpCapability = 17, OpMemoryModel = 14, OpEntryPoint = 15,
+	OpDecorate = 71, OpTypeVoid = 19, OpTypeFunction = 33,
+	OpTypeFloat = 22, OpTypePointer = 32, OpVariable = 59,
+	OpFunction = 54, OpLabel = 248, OpReturn = 253, OpFunctionEnd = 56,
+	WordCountShift = 16, OpCodeMask = 0xFFFF, MagicNumber = 0x07230203,
+	CapabilityShader = 1, MemoryModelGLSL450 = 1, Vertex = 0,
+	Location = 30, Input = 1,
+};
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+// A piece of SPIR-V, and the Component it turned into.
+typedef struct {
+	const char* name;
+	uint32_t* code;
+	size_t size;	// In words
+	VvVkS_Component* comp;
+} shader;
+
+static int readShader(shader* s, const char* path) {
+	FILE* f = fopen(path, "rb");
+	if(!f) return 0;
+	fseek(f, 0, SEEK_END);
+	long bytes = ftell(f);
+	rewind(f);
+	s->name = path;
+	s->size = bytes / sizeof(uint32_t);
+	s->code = malloc(bytes);
+	s->size = fread(s->code, sizeof(uint32_t), s->size, f);
+	fclose(f);
+	return 1;
+}
+
+static VvVkS_Component* loadCode(VvVkS_Bank* bank, const uint32_t* code,
+	size_t size) {
+
+	return vVvks_loadShader(bank, &(VkShaderModuleCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		.codeSize = size*sizeof(uint32_t),
+		.pCode = code,
+	});
+}
+
+// A vertex shader with <n> float Inputs at Locations from <first>, and an
+// empty main. Big interfaces like these are where a merge can go quadratic.
+static uint32_t* genInputs(uint32_t n, uint32_t first, size_t* size) {
+	size_t sz = 5 + 2 + 3 + (5+n) + 4*n + 2+3+3+4 + 4*n + 5+2+1+1;
+	uint32_t* c = malloc(sz*sizeof(uint32_t));
+	size_t h = 0;
+#define INS(OP, ...) ({ \
+	uint32_t ops[] = {__VA_ARGS__}; \
+	size_t wc = 1 + sizeof(ops)/sizeof(uint32_t); \
+	c[h++] = wc<<WordCountShift | OP; \
+	memcpy(&c[h], ops, sizeof(ops)); \
+	h += wc-1; \
+})
+	// <id>s: 1 void, 2 void(), 3 float, 4 Input float*, 5 main, 6 label,
+	// and the variables from 7.
+	c[h++] = MagicNumber;
+	c[h++] = 0x00010000;
+	c[h++] = 0;
+	c[h++] = 7+n;
+	c[h++] = 0;
+	INS(OpCapability, CapabilityShader);
+	INS(OpMemoryModel, 0, MemoryModelGLSL450);
+	c[h++] = (5+n)<<WordCountShift | OpEntryPoint;
+	c[h++] = Vertex;
+	c[h++] = 5;
+	c[h++] = 0x6E69616D;	// "main"
+	c[h++] = 0;
+	for(uint32_t i=0; i<n; i++) c[h++] = 7+i;
+	for(uint32_t i=0; i<n; i++)
+		INS(OpDecorate, 7+i, Location, first+i);
+	INS(OpTypeVoid, 1);
+	INS(OpTypeFunction, 2, 1);
+	INS(OpTypeFloat, 3, 32);
+	INS(OpTypePointer, 4, Input, 3);
+	for(uint32_t i=0; i<n; i++)
+		INS(OpVariable, 4, 7+i, Input);
+	INS(OpFunction, 1, 5, 0, 2);
+	INS(OpLabel, 6);
+	INS(OpReturn);
+	INS(OpFunctionEnd);
+#undef INS
+	*size = h;
+	return c;
+}
+
+// Run constructCode on <cs> for a while, and print how long it took.
+static double bench(VvVkS_Bank* bank, const char* name,
+	size_t nc, shader** ss) {
+
+	VvVkS_Component* cs[nc];
+	size_t words = 0;
+	for(size_t i=0; i<nc; i++) {
+		cs[i] = ss[i]->comp;
+		words += ss[i]->size;
+	}
+	size_t reps = 0;
+	double start = now(), end;
+	do {
+		size_t bytes;
+		uint32_t* code = vVvks_constructCode(bank, nc, cs, NULL, &bytes);
+		if(!code) {
+			printf("%-28s failed to construct!\n", name);
+			return 0;
+		}
+		vVvks_destroyCode(bank, code);
+		reps++;
+		end = now();
+	} while(end - start < 2e8);	// 0.2s
+
+	double ns = (end - start) / reps;
+	printf("%-28s %2zu comps %7zu words: %10.0f ns, %7.0f ns/comp,"
+		" %6.1f Mwords/s\n", name, nc, words, ns, ns/nc, words/ns*1e3);
+	return ns;
+}
+
+// How constructBatch scales from one thread to every core. It makes real
+// ShaderModules, so this needs a Device, and is skipped without one.
+static void benchBatch(VvVkS_Bank* bank, shader* ss) {
+	printf("\nconstructBatch on the vkhelp shaders:\n");
+	vVvk_load();
+	VkInstance inst;
+	VkResult r = vVvkb_createInstance(&VvVkB_InstInfo(
+		.name = "ShaderBank Benchmark", .version = 0,
+	), &inst);
+	if(r < 0) {
+		printf("No Instance (%d), skipping.\n", r);
+		vVvk_unload();
+		return;
+	}
+	vVvk_loadInst(inst, 0);
+	VkDevice dev;
+	VkPhysicalDevice pdev;
+	VvVkB_QueueSpec qs;
+	r = vVvkb_createDevice(&VvVkB_DevInfo(
+		Vv_ARRAY(tasks, (VvVkB_TaskInfo[]){
+			{.flags=VK_QUEUE_GRAPHICS_BIT},
+		}),
+	), inst, &dev, &pdev, &qs);
+	if(r < 0) {
+		printf("No Device (%d), skipping.\n", r);
+		vVvk_DestroyInstance(inst, NULL);
+		vVvk_unload();
+		return;
+	}
+	vVvk_loadDev(dev, 1);
+
+	// The four sets the demo uses, over and over.
+	enum { NB = 64 };
+	VvVkS_Component* sets[4][5] = {
+		{ss[0].comp, ss[2].comp, ss[4].comp},
+		{ss[0].comp, ss[1].comp, ss[2].comp, ss[4].comp},
+		{ss[0].comp, ss[2].comp, ss[3].comp, ss[4].comp},
+		{ss[0].comp, ss[1].comp, ss[2].comp, ss[3].comp, ss[4].comp},
+	};
+	size_t setcnts[4] = {3, 4, 4, 5};
+	size_t ncs[NB];
+	VvVkS_Component** css[NB];
+	VkShaderModule sms[NB];
+	for(int i=0; i < NB; i++) {
+		ncs[i] = setcnts[i%4];
+		css[i] = sets[i%4];
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	if(cores < 1) cores = 1;
+	double one = 0;
+	for(long t = 1;; t = 2*t < cores ? 2*t : cores) {
+		size_t reps = 0;
+		double start = now(), end;
+		do {
+			r = vVvks_constructBatch(bank, dev, NB, ncs, css, t, sms);
+			for(int i=0; i < NB; i++)
+				if(sms[i]) vVvk_DestroyShaderModule(dev, sms[i], NULL);
+			reps++;
+			end = now();
+		} while(r >= 0 && end - start < 2e8);	// 0.2s
+		if(r < 0) {
+			printf("%2ld threads: failed to construct (%d)!\n", t, r);
+			break;
+		}
+		double ns = (end - start) / reps;
+		if(t == 1) one = ns;
+		printf("%2ld threads %2d shaders: %10.0f ns, %7.0f ns/shader,"
+			" %5.2fx\n", t, NB, ns, ns/NB, one/ns);
+		if(t >= cores) break;
+	}
+
+	vVvk_DestroyDevice(dev, NULL);
+	vVvk_DestroyInstance(inst, NULL);
+	vVvk_unload();
+}
+
+static const char* corpus[] = {
+	"load.spv", "small.spv", "base.spv", "recolor.spv", "render.spv",
+};
+#define NCORPUS (sizeof(corpus)/sizeof(corpus[0]))
+
+static int runBench(VvVkS_Bank* bank, shader* ss) {
+	shader *load = &ss[0], *small = &ss[1], *base = &ss[2],
+		*recolor = &ss[3], *render = &ss[4];
+
+	printf("The vkhelp shaders, as the demo constructs them:\n");
+	bench(bank, "AD", 3, (shader*[]){load, base, render});
+	bench(bank, "ad", 4, (shader*[]){load, small, base, render});
+	bench(bank, "BC", 4, (shader*[]){load, base, recolor, render});
+	bench(bank, "bc", 5, (shader*[]){load, small, base, recolor, render});
+
+	printf("\nWith the optimization levels:\n");
+	for(int l=0; l<=2; l++) {
+		char name[32];
+		sprintf(name, "bc at level %d", l);
+		vVvks_setOptimization(bank, l);
+		bench(bank, name, 5, (shader*[]){load, small, base, recolor, render});
+	}
+	vVvks_setOptimization(bank, 0);
+
+	// If construct is linear the ns/word stays put as the interfaces grow.
+	printf("\nFour Components with big interfaces:\n");
+	for(uint32_t n = 250; n <= 16000; n *= 4) {
+		shader big[4];
+		for(int i=0; i<4; i++) {
+			big[i].code = genInputs(n, i*n, &big[i].size);
+			big[i].comp = loadCode(bank, big[i].code, big[i].size);
+		}
+		char name[32];
+		sprintf(name, "%u Inputs each", n);
+		double ns = bench(bank, name, 4,
+			(shader*[]){&big[0], &big[1], &big[2], &big[3]});
+		printf("%28s %.2f ns/word\n", "",
+			ns / (big[0].size+big[1].size+big[2].size+big[3].size));
+		for(int i=0; i<4; i++) {
+			vVvks_unloadShader(bank, big[i].comp);
+			free(big[i].code);
+		}
+	}
+
+	// A stack of layers, once from scratch and once a layer at a time.
+	printf("\nA stack of 16 layers, all the way up:\n");
+	enum { NL = 16 };
+	shader layers[NL];
+	for(int i=0; i<NL; i++) {
+		layers[i].code = genInputs(200, i*200, &layers[i].size);
+		layers[i].comp = loadCode(bank, layers[i].code, layers[i].size);
+	}
+	VvVkS_Component* ls[NL];
+	for(int i=0; i<NL; i++) ls[i] = layers[i].comp;
+	VvVkS_Component* prefix[NL];	// prefix[i] is layers 0 to i, merged
+	double start = now();
+	prefix[0] = ls[0];
+	for(int n=1; n < NL; n++)
+		prefix[n] = vVvks_constructComponent(bank, 2,
+			(VvVkS_Component*[]){prefix[n-1], ls[n]});
+	printf("%-28s %10.0f ns\n", "making the prefixes", now() - start);
+	size_t bytes;
+	start = now();
+	for(int n=1; n <= NL; n++)
+		vVvks_destroyCode(bank, vVvks_constructCode(bank, n, ls, NULL, &bytes));
+	printf("%-28s %10.0f ns\n", "every stack, from scratch", now() - start);
+	start = now();
+	vVvks_destroyCode(bank, vVvks_constructCode(bank, 1, ls, NULL, &bytes));
+	for(int n=2; n <= NL; n++)
+		vVvks_destroyCode(bank, vVvks_constructCode(bank, 2,
+			(VvVkS_Component*[]){prefix[n-2], ls[n-1]}, NULL, &bytes));
+	printf("%-28s %10.0f ns\n", "every stack, from a prefix", now() - start);
+	for(int n=1; n < NL; n++) vVvks_unloadShader(bank, prefix[n]);
+	for(int i=0; i<NL; i++) {
+		vVvks_unloadShader(bank, layers[i].comp);
+		free(layers[i].code);
+	}
+
+	// How much packing the Components saves, and what it costs.
+	printf("\nWith the Components packed:\n");
+	VvVkS_Bank* pbank = vVvks_createBank();
+	vVvks_setCompression(pbank, 1);
+	shader packed[NCORPUS];
+	for(size_t i=0; i < NCORPUS; i++) {
+		packed[i] = ss[i];
+		packed[i].comp = loadCode(pbank, ss[i].code, ss[i].size);
+	}
+	size_t orig, held = vVvks_getCodeSize(pbank, &orig);
+	printf("%-28s %zu of %zu bytes (%.1f%%)\n", "packed size", held, orig,
+		100.0*held/orig);
+	bench(pbank, "bc, packed", 5, (shader*[]){&packed[0], &packed[1],
+		&packed[2], &packed[3], &packed[4]});
+	vVvks_destroyBank(pbank);
+
+	benchBatch(bank, ss);
+	return 0;
+}
+
+static void writeShader(const char* path, const uint32_t* code, size_t size) {
+	FILE* f = fopen(path, "wb");
+	if(!f) return;
+	fwrite(code, sizeof(uint32_t), size, f);
+	fclose(f);
+}
+
+// Scramble <code> a little. Mostly small changes, since those are the ones
+// that get past the checks on load.
+static void mutate(uint32_t* code, size_t size) {
+	int cnt = 1 + rand()%4;
+	for(int i=0; i<cnt; i++) {
+		size_t at = 5 + rand()%(size-5);
+		switch(rand()%5) {
+		case 0: code[at] ^= 1u << rand()%32; break;
+		case 1: code[at] = rand()%64; break;
+		case 2: code[at] += rand()%3 - 1; break;
+		case 3: {
+			size_t to = 5 + rand()%(size-5);
+			uint32_t w = code[at];
+			code[at] = code[to];
+			code[to] = w;
+			break;
+		}
+		case 4: code[at] = (code[at] & OpCodeMask)
+			| (rand()%8) << WordCountShift; break;
+		}
+	}
+}
+
+static int cmpDouble(const void* a, const void* b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+// The median time constructCode takes on <cs> over a few runs, per word.
+static double medianConstruct(VvVkS_Bank* bank, size_t nc,
+	VvVkS_Component** cs, size_t words) {
+
+	enum { RUNS = 5 };
+	double ts[RUNS];
+	for(int i=0; i < RUNS; i++) {
+		size_t bytes;
+		double start = now();
+		vVvks_destroyCode(bank, vVvks_constructCode(bank, nc, cs, NULL,
+			&bytes));
+		ts[i] = (now() - start) / words;
+	}
+	qsort(ts, RUNS, sizeof(double), cmpDouble);
+	return ts[RUNS/2];
+}
+
+static int runFuzz(VvVkS_Bank* bank, shader* ss, size_t nss, long iters) {
+	// Find how long the corpus takes per word, to tell when a mutant is slow.
+	double base = 0;
+	for(size_t i=0; i < nss; i++) {
+		double start = now();
+		size_t bytes;
+		for(int j=0; j<10; j++)
+			vVvks_destroyCode(bank, vVvks_constructCode(bank, 1,
+				&ss[i].comp, NULL, &bytes));
+		double per = (now() - start) / 10 / ss[i].size;
+		if(per > base) base = per;
+	}
+
+	long loaded = 0, merged = 0, slow = 0;
+	for(long i=0; i < iters; i++) {
+		shader* s = &ss[rand() % nss];
+		shader* other = &ss[rand() % nss];
+		uint32_t* code = malloc(s->size*sizeof(uint32_t));
+		memcpy(code, s->code, s->size*sizeof(uint32_t));
+		mutate(code, s->size);
+		writeShader("fuzz-current.spv", code, s->size);
+
+		VvVkS_Component* c = loadCode(bank, code, s->size);
+		if(c) {
+			loaded++;
+			VvVkS_Component* sets[3][2] = {{c}, {other->comp, c},
+				{c, other->comp}};
+			size_t ncs[3] = {1, 2, 2};
+			for(int j=0; j<3; j++) {
+				size_t bytes, words = s->size + (ncs[j] > 1 ? other->size : 0);
+				double start = now();
+				uint32_t* out = vVvks_constructCode(bank, ncs[j], sets[j],
+					NULL, &bytes);
+				double per = (now() - start) / words;
+				if(out) merged++;
+				vVvks_destroyCode(bank, out);
+
+				// One slow run could just be the machine, so check again
+				if(per > 100*base)
+					per = medianConstruct(bank, ncs[j], sets[j], words);
+				if(per > 100*base) {
+					char name[48];
+					sprintf(name, "fuzz-slow-%ld.spv", i);
+					writeShader(name, code, s->size);
+					printf("Mutant %ld of %s took %.0f ns/word!\n", i,
+						s->name, per);
+					slow++;
+				}
+			}
+			vVvks_unloadShader(bank, c);
+		}
+		free(code);
+	}
+	remove("fuzz-current.spv");
+	printf("%ld mutants: %ld loaded, %ld constructs made it, %ld slow\n",
+		iters, loaded, merged, slow);
+	return slow ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	V = vV();
+	int fuzz = argc > 1 && strcmp(argv[1], "fuzz") == 0;
+	long iters = argc > 2 ? atol(argv[2]) : 1000;
+	srand(argc > 3 ? atoi(argv[3]) : 1);
+
+	VvVkS_Bank* bank = vVvks_createBank();
+	shader ss[NCORPUS+1];
+	for(size_t i=0; i < NCORPUS; i++) {
+		if(!readShader(&ss[i], corpus[i])) {
+			fprintf(stderr, "Couldn't read %s!\n", corpus[i]);
+			return 1;
+		}
+		ss[i].comp = loadCode(bank, ss[i].code, ss[i].size);
+		if(!ss[i].comp) {
+			fprintf(stderr, "Couldn't load %s!\n", corpus[i]);
+			return 1;
+		}
+	}
+	// And one of the generated ones, so the fuzzing covers big interfaces.
+	ss[NCORPUS].name = "generated";
+	ss[NCORPUS].code = genInputs(64, 0, &ss[NCORPUS].size);
+	ss[NCORPUS].comp = loadCode(bank, ss[NCORPUS].code, ss[NCORPUS].size);
+
+	int r = fuzz ? runFuzz(bank, ss, NCORPUS+1, iters) : runBench(bank, ss);
+
+	vVvks_destroyBank(bank);
+	for(size_t i=0; i <= NCORPUS; i++) free(ss[i].code);
+	return r;
+}
@@ -21,15 +21,57 @@
 
 #include <vivacious/vkpipeline.h>
 #include "internal.h"
+#include "workpool.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 
+// A State transition that record makes.
+typedef struct {
+	void* udata;
+	int set;	// Or unset
+} planTrans;
+
+// What record does for a Step.
+typedef struct {
+	VvVkP_Step* step;
+	void* udata;
+	size_t trans;	// The Step's first planTrans
+	uint32_t pre;	// planTrans before the next subpasses
+	uint32_t next;	// Subpasses to move on by
+	uint32_t post;	// planTrans after the barrier
+	VkPipelineStageFlags src, dst;	// The barrier, if there's any memory
+	VkDependencyFlags flags;
+	uint32_t memcnt, imgcnt;
+	VkMemoryBarrier mem;
+	size_t img;	// The first of the plan's imgs
+} planStep;
+
+// A RenderPass made by getRenderPass, with everything that went into it.
+typedef struct {
+	uint64_t hash;
+	unsigned char* key;
+	size_t size;
+	VkRenderPass rpass;
+	size_t used;	// The last g->passes.frame it was used in
+} cachedPass;
+
 struct VvVkP_Graph {
 	VkRenderPass rpass;	// Because we must remember.
 	VkDevice dev;
 	PFN_vkDestroyRenderPass drpass;
+
+	// Every RenderPass still around, including g->rpass. The others are
+	// destroyed once <keep> records have gone by without them.
+	struct {
+		cachedPass* data;
+		size_t cnt, max;
+		size_t keep;
+		size_t frame;	// Records so far
+	} passes;
 	VkImageLayout* layouts;	// Saving info for attachment-based deps.
+	size_t attachcnt;	// Per subpass, in layouts
+	uint32_t layoutsubs;	// Subpasses in layouts
 
 	// Doubly-linked list for the States.
 	struct {
@@ -37,13 +79,72 @@ struct VvVkP_Graph {
 		VvVkP_State* end;
 	} stats;
 
-	// Doubly-linked list for the Steps.
+	// Doubly-linked list for the Steps, in the order they were added.
 	struct {
 		VvVkP_Step* begin;
 		VvVkP_Step* end;
+		size_t cnt;
 	} steps;
 
-	int second;	// Since we only have one subpass, global contents
+	// The Steps in an order that respects their dependencies, with the
+	// Steps of each subpass together. This is only worked out when it's
+	// needed, since Steps tend to be added in bulk.
+	struct {
+		VvVkP_Step** data;
+		int valid;
+	} order;
+	uint32_t spasscnt;
+
+	// The States each Step in g->order uses, as a bitset of <words> words
+	// per Step, so record only has to look at the States that change.
+	struct {
+		size_t words;
+		uint64_t* data;
+		uint64_t* bound;	// The subpass-bound States
+		uint64_t* cur;	// The States set so far, while recording
+		VvVkP_State** stats;	// By bit
+	} bits;
+
+	// Everything record does, in order. This is worked out by compile (or
+	// by record, if the Graph changed since) so that recording is a single
+	// walk through flat arrays.
+	struct {
+		int valid;
+		planStep* steps;	// One for each in g->order
+		VkImageMemoryBarrier* imgs;
+		uint32_t* atts;	// The attachment each of imgs is for
+		size_t imgcnt, imgmax;
+		planTrans* trans;
+		size_t transcnt, transmax;
+		size_t last;	// The planTrans after the last Step
+	} plan;
+
+	int second;	// Same contents for every subpass
+
+	// The pool for the Steps' cached CommandBuffers, see setCache.
+	struct {
+		VkDevice dev;
+		VkCommandPool pool;	// VK_NULL_HANDLE if not caching
+		VkRenderPass rpass;	// That the CommandBuffers continue
+		VkCommandBuffer* cbs;	// For each vkCmdExecuteCommands
+		size_t cbmax;
+	} cache;
+
+	// For recording in chunks on many threads, see setParallel. Pools
+	// aren't thread-safe, so each chunk gets its own.
+	struct {
+		_vVpool* workers;	// NULL if not recording in parallel
+		int threads;
+		VkDevice dev;
+		uint32_t family;
+		VkCommandPool* pools;
+		VkCommandBuffer* cbs;	// One from each of pools
+		size_t made;	// Pools so far
+		size_t* starts;	// The first planStep of each chunk, and the end
+		size_t cnt, max;
+	} par;
+
+	VvVkP_Counts counts;	// From the last record
 };
 
 struct VvVkP_State {
@@ -51,6 +152,9 @@ struct VvVkP_State {
 	VvVkP_State* next;
 	void* udata;
 	int bound;	// subpass-bound flag
+	uint32_t subpass;
+	size_t first;	// First Step that uses it, for partition.
+	size_t bit;	// In g->bits
 };
 #define FREE_ST(st) (\
 free(st))
@@ -67,8 +171,24 @@ struct VvVkP_Step {
 
 	struct {
 		int cnt;
+		int live;	// The rest are implied by these, see reduce.
 		VvVkP_Dependency* data;
 	} depends;
+
+	uint32_t subpass;
+	VkCommandBuffer cb;	// Cached commands, see setCache
+	int dirty;	// cb needs to be recorded again
+
+	// What cb was recorded for, so makePlan can tell if it still holds.
+	struct {
+		uint32_t subpass;
+		VkPipelineStageFlags src, dst;
+		VkDependencyFlags flags;
+		VkAccessFlags srcAccess, dstAccess;
+	} planned;
+	size_t pos;	// Position in g->order
+	size_t index;	// Position in the Graph's list, for sortSteps.
+	size_t waiting;	// Dependencies not yet placed, for sortSteps.
 };
 #define FREE_SP(sp) (\
 free((sp)->stats.data), \
@@ -79,8 +199,17 @@ static VvVkP_Graph* create(const Vv* V) {
 	VvVkP_Graph* g = malloc(sizeof(VvVkP_Graph));
 	*g = (VvVkP_Graph){
 		.stats.begin = NULL, .stats.end = NULL,
-		.steps.begin = NULL, .steps.end = NULL,
-		.second = -1, .layouts = NULL, .rpass = VK_NULL_HANDLE,
+		.steps.begin = NULL, .steps.end = NULL, .steps.cnt = 0,
+		.order.data = NULL, .order.valid = 0, .spasscnt = 1,
+		.second = -1, .layouts = NULL, .attachcnt = 0,
+		.rpass = VK_NULL_HANDLE,
+		.passes = {NULL, 0, 0, 0, 0},
+		.bits = {0, NULL, NULL, NULL, NULL},
+		.plan = {0, NULL, NULL, NULL, 0, 0, NULL, 0, 0, 0},
+		.cache = {NULL, VK_NULL_HANDLE, VK_NULL_HANDLE, NULL, 0},
+		.par = {NULL, 0, NULL, 0, NULL, NULL, 0, NULL, 0, 0},
+		.layoutsubs = 0,
+		.counts = {0},
 	};
 	return g;
 }
@@ -100,8 +229,29 @@ static void destroy(const Vv* V, VvVkP_Graph* g) {
 	}
 	if(sp) FREE_SP(sp);
 
+	free(g->order.data);
+	free(g->bits.data);
+	free(g->bits.bound);
+	free(g->bits.cur);
+	free(g->bits.stats);
+	free(g->plan.steps);
+	free(g->plan.imgs);
+	free(g->plan.atts);
+	free(g->plan.trans);
+	if(g->cache.pool) vVvk_DestroyCommandPool(g->cache.dev, g->cache.pool, NULL);
+	free(g->cache.cbs);
+	for(size_t i=0; i < g->par.made; i++)
+		vVvk_DestroyCommandPool(g->par.dev, g->par.pools[i], NULL);
+	if(g->par.workers) _vVpooldestroy(g->par.workers);
+	free(g->par.pools);
+	free(g->par.cbs);
+	free(g->par.starts);
 	if(g->layouts) free(g->layouts);
-	if(g->rpass) g->drpass(g->dev, g->rpass, NULL);
+	for(size_t i=0; i < g->passes.cnt; i++) {
+		g->drpass(g->dev, g->passes.data[i].rpass, NULL);
+		free(g->passes.data[i].key);
+	}
+	free(g->passes.data);
 
 	free(g);
 }
@@ -110,74 +260,528 @@ static VvVkP_State* addSt(const Vv* V, VvVkP_Graph* g, void* udata, int bound) {
 	VvVkP_State* sp = malloc(sizeof(VvVkP_State));
 	*sp = (VvVkP_State){
 		.prev = g->stats.end, .next = NULL,
-		.udata = udata, .bound = bound ? 1 : 0,
+		.udata = udata, .bound = bound ? 1 : 0, .subpass = 0,
 	};
 	if(!g->stats.begin) g->stats.begin = sp;
 	if(g->stats.end) g->stats.end->next = sp;
 	g->stats.end = sp;
+	g->order.valid = 0;
 	return sp;
 }
 
-static void insert(VvVkP_Graph* g, VvVkP_Step* sp) {
-	int missing = sp->depends.cnt;
-	sp->prev = sp->next = NULL;
-	struct {
-		VvVkP_Step* begin;
-		VvVkP_Step* end;
-	} strip = {sp, sp};
-	VvVkP_Step* here = g->steps.begin;
-	while(missing > 0 && here != NULL) {
-		int needsus = 0;
-		for(int i=0; i < here->depends.cnt; i++) {
-			for(VvVkP_Step* us = sp; us; us = us->next) {
-				if(here->depends.data[i].step == us) {
-					needsus = 1;
-					break;
+static void append(VvVkP_Graph* g, VvVkP_Step* sp) {
+	sp->prev = g->steps.end;
+	sp->next = NULL;
+	if(!g->steps.begin) g->steps.begin = sp;
+	if(g->steps.end) g->steps.end->next = sp;
+	g->steps.end = sp;
+	g->steps.cnt++;
+	g->order.valid = 0;
+}
+
+// A min-heap of Step indices, so that Steps that are free to go in any
+// order stay in the order they were added.
+static void heapPush(size_t* heap, size_t* cnt, size_t v) {
+	size_t i = (*cnt)++;
+	while(i > 0 && heap[(i-1)/2] > v) {
+		heap[i] = heap[(i-1)/2];
+		i = (i-1)/2;
+	}
+	heap[i] = v;
+}
+
+static size_t heapPop(size_t* heap, size_t* cnt) {
+	size_t top = heap[0], v = heap[--(*cnt)], i = 0;
+	while(2*i+1 < *cnt) {
+		size_t c = 2*i+1;
+		if(c+1 < *cnt && heap[c+1] < heap[c]) c++;
+		if(heap[c] >= v) break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = v;
+	return top;
+}
+
+static size_t findSet(size_t* parent, size_t i) {
+	while(parent[i] != i) i = parent[i] = parent[parent[i]];
+	return i;
+}
+
+// Split the <n> Steps in g->order into subpasses. Steps that share a bound
+// State share a subpass, and each run of Steps without one (in g->order) gets
+// a subpass of its own. The subpasses are
+// then sorted by the dependencies between them (<first> and <after> list the
+// Steps after each, by index into <list>), and g->order is regrouped to
+// match.
+static void partition(VvVkP_Graph* g, size_t n, VvVkP_Step** list,
+	const size_t* first, const size_t* after) {
+
+	size_t* parent = malloc(n*sizeof(size_t));
+	char* bound = calloc(n, 1);
+	for(size_t i=0; i < n; i++) parent[i] = i;
+	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
+		st->first = SIZE_MAX;
+	for(size_t i=0; i < n; i++) {
+		for(int j=0; j < list[i]->stats.cnt; j++) {
+			VvVkP_State* st = list[i]->stats.data[j];
+			if(!st->bound) continue;
+			bound[i] = 1;
+			if(st->first == SIZE_MAX) st->first = i;
+			else parent[findSet(parent, i)] = findSet(parent, st->first);
+		}
+	}
+
+	// The unbound Steps could go anywhere. Putting all of them together
+	// would make a cycle out of the common clear, draw, post-process, so
+	// only the ones that are next to each other in the order are.
+	for(size_t i=1; i < n; i++) {
+		size_t a = g->order.data[i-1]->index, b = g->order.data[i]->index;
+		if(!bound[a] && !bound[b])
+			parent[findSet(parent, b)] = findSet(parent, a);
+	}
+	free(bound);
+
+	// Number the groups in the order they first show up, and list the
+	// Steps in each.
+	size_t* group = malloc(n*sizeof(size_t));	// By root, then Step
+	size_t* members = calloc(n+1, sizeof(size_t));
+	size_t* wait = calloc(n+1, sizeof(size_t));
+	for(size_t i=0; i < n; i++) group[i] = SIZE_MAX;
+	size_t gcnt = 0;
+	for(size_t i=0; i < n; i++) {
+		size_t r = findSet(parent, g->order.data[i]->index);
+		if(group[r] == SIZE_MAX) group[r] = gcnt++;
+		members[group[r]+1]++;
+	}
+	for(size_t i=0; i < n; i++)
+		list[i]->subpass = group[findSet(parent, i)];
+	free(parent);
+
+	members[0] = 0;
+	for(size_t i=0; i < gcnt; i++) members[i+1] += members[i];
+	size_t* fill = malloc((gcnt+1)*sizeof(size_t));
+	memcpy(fill, members, (gcnt+1)*sizeof(size_t));
+	VvVkP_Step** regroup = malloc(n*sizeof(VvVkP_Step*));
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		regroup[fill[sp->subpass]++] = sp;
+		for(int j=0; j < sp->depends.cnt; j++)
+			if(sp->depends.data[j].step->subpass != sp->subpass)
+				wait[sp->subpass]++;
+	}
+
+	// Kahn's again, this time over the groups. Groups that depend on each
+	// other in a cycle can't be ordered, so they (and the groups after them)
+	// are merged into one last subpass instead.
+	size_t* rank = group;
+	for(size_t gr=0; gr < gcnt; gr++) rank[gr] = SIZE_MAX;
+	size_t* heap = fill;
+	size_t heapcnt = 0, ranked = 0;
+	for(size_t i=0; i < gcnt; i++)
+		if(wait[i] == 0) heapPush(heap, &heapcnt, i);
+	while(heapcnt > 0) {
+		size_t gr = heapPop(heap, &heapcnt);
+		rank[gr] = ranked++;
+		for(size_t m = members[gr]; m < members[gr+1]; m++) {
+			size_t i = regroup[m]->index;
+			for(size_t j = first[i]; j < first[i+1]; j++) {
+				uint32_t to = list[after[j]]->subpass;
+				if(to != gr && --wait[to] == 0) heapPush(heap, &heapcnt, to);
+			}
+		}
+	}
+
+	size_t* byrank = wait;
+	for(size_t gr=0; gr < gcnt; gr++)
+		if(rank[gr] != SIZE_MAX) byrank[rank[gr]] = gr;
+	for(size_t i=0; i < n; i++)
+		if(rank[list[i]->subpass] == SIZE_MAX) list[i]->subpass = UINT32_MAX;
+	VvVkP_Step** out = malloc(n*sizeof(VvVkP_Step*));
+	size_t at = 0;
+	for(size_t r=0; r < ranked; r++) {
+		size_t gr = byrank[r];
+		for(size_t m = members[gr]; m < members[gr+1]; m++) {
+			regroup[m]->subpass = r;
+			out[at++] = regroup[m];
+		}
+	}
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		if(sp->subpass == UINT32_MAX) {
+			sp->subpass = ranked;
+			out[at++] = sp;
+		}
+	}
+	free(g->order.data);
+	g->order.data = out;
+	g->spasscnt = ranked < gcnt ? ranked+1 : ranked ? ranked : 1;
+
+	// States take the subpass of the first Step that uses them.
+	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
+		st->first = SIZE_MAX;
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		for(int j=0; j < sp->stats.cnt; j++)
+			if(sp->stats.data[j]->first == SIZE_MAX) {
+				sp->stats.data[j]->first = i;
+				sp->stats.data[j]->subpass = sp->subpass;
+			}
+	}
+	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
+		if(st->first == SIZE_MAX) st->subpass = 0;
+
+	free(group);
+	free(members);
+	free(wait);
+	free(fill);
+	free(regroup);
+}
+
+static int sameRange(const VkImageSubresourceRange* a,
+	const VkImageSubresourceRange* b) {
+	return a->aspectMask == b->aspectMask
+		&& a->baseMipLevel == b->baseMipLevel
+		&& a->levelCount == b->levelCount
+		&& a->baseArrayLayer == b->baseArrayLayer
+		&& a->layerCount == b->layerCount;
+}
+
+// The flags a Dependency might end up with, the weakest of which is what
+// it can be relied on for.
+static VkDependencyFlags regionFlags(const VvVkP_Dependency* d) {
+	return d->flags | (d->attachmentEnable ? VK_DEPENDENCY_BY_REGION_BIT : 0);
+}
+
+// Whether the memory <a> makes available (or visible) includes <b>'s.
+static int sameMemory(const VvVkP_Dependency* a, const VvVkP_Dependency* b) {
+	return !a->attachmentEnable || (b->attachmentEnable
+		&& a->attachment == b->attachment
+		&& sameRange(&a->attachmentRange, &b->attachmentRange));
+}
+
+static int startsLike(const VvVkP_Dependency* a, const VvVkP_Dependency* e) {
+	return !(e->srcStage & ~a->srcStage) && !(e->srcAccess & ~a->srcAccess)
+		&& !(regionFlags(a) & ~e->flags) && sameMemory(a, e);
+}
+
+static int endsLike(const VvVkP_Dependency* a, const VvVkP_Dependency* e) {
+	return !(e->dstStage & ~a->dstStage) && !(e->dstAccess & ~a->dstAccess)
+		&& !(regionFlags(a) & ~e->flags) && sameMemory(a, e);
+}
+
+typedef struct {
+	size_t to;	// Position of the Step that depends
+	size_t id;
+	const VvVkP_Dependency* d;
+} link;
+
+typedef struct {
+	size_t at;
+	VkPipelineStageFlags stages;	// Of the link that got here
+} reach;
+
+// Drop the dependencies that are implied by a chain of others between the
+// same two Steps. The chain has to sync at least as much: its first link
+// covers the source side, its last link the destination side, and each link
+// shares a stage with the next (so they form an execution dependency chain).
+// The links a chain is made of are always closer together than the
+// dependency it replaces, so no two dependencies can imply each other away.
+// Each search starts from at most REDUCE_WORK of the nearest links and follows
+// at most REDUCE_WORK more before giving up (keeping the dependency, which is
+// always safe), so a Step that many others depend on doesn't make this
+// quadratic. Each Step's live dependencies are moved to the front of its list,
+// and the number dropped is returned. Needs the positions in g->order.
+#define REDUCE_WORK 256
+static size_t reduce(VvVkP_Graph* g, size_t n) {
+	// The links out of each Step, by position (and then by where they go)
+	size_t* first = calloc(n+1, sizeof(size_t));
+	size_t e = 0;
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		for(int j=0; j < sp->depends.cnt; j++)
+			first[sp->depends.data[j].step->pos + 1]++;
+		e += sp->depends.cnt;
+	}
+	for(size_t i=0; i < n; i++) first[i+1] += first[i];
+	link* out = malloc(e*sizeof(link));
+	size_t* fill = malloc(n*sizeof(size_t));
+	memcpy(fill, first, n*sizeof(size_t));
+	size_t id = 0;
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		for(int j=0; j < sp->depends.cnt; j++, id++) {
+			const VvVkP_Dependency* d = &sp->depends.data[j];
+			out[fill[d->step->pos]++] = (link){i, id, d};
+		}
+	}
+	free(fill);
+
+	// Look for a chain standing in for each dependency, from its source
+	// Step up to (but not past) the Step that depends on it.
+	char* implied = calloc(e ? e : 1, 1);
+	size_t* stamp = calloc(n, sizeof(size_t));
+	VkPipelineStageFlags* seen = malloc(n*sizeof(VkPipelineStageFlags));
+	size_t stkmax = 16, stkcnt = 0, dropped = 0;
+	reach* stk = malloc(stkmax*sizeof(reach));
+	#define PUSH(AT, STAGES) do { \
+		if(stamp[AT] == id+1 && !((STAGES) & ~seen[AT])) break; \
+		stamp[AT] = id+1, seen[AT] = (STAGES); \
+		if(stkcnt == stkmax) stk = realloc(stk, (stkmax*=2)*sizeof(reach)); \
+		stk[stkcnt++] = (reach){AT, STAGES}; \
+	} while(0)
+	id = 0;
+	for(size_t v=0; v < n; v++) {
+		VvVkP_Step* sp = g->order.data[v];
+		for(int j=0; j < sp->depends.cnt; j++, id++) {
+			const VvVkP_Dependency* d = &sp->depends.data[j];
+			size_t u = d->step->pos;
+			if(u >= v) continue;	// Part of a cycle
+			int found = 0;
+			size_t work = 0;
+			stkcnt = 0;
+			// Only the links that land in (u, v] matter. Of those, only the
+			// nearest ones are looked at, and pushed last so they go first.
+			size_t lo = first[u], hi = first[u+1];
+			while(lo < hi) {
+				size_t mid = lo + (hi-lo)/2;
+				if(out[mid].to <= v) lo = mid+1;
+				else hi = mid;
+			}
+			size_t start = lo-first[u] > REDUCE_WORK ? lo-REDUCE_WORK : first[u];
+			for(size_t k = start; k < lo && !found; k++) {
+				const link* l = &out[k];
+				if(l->to <= u || l->id == id || !startsLike(l->d, d)) continue;
+				if(l->to == v) {
+					// Only the first of two equivalent ones is kept
+					found = endsLike(l->d, d) && (l->id < id
+						|| !startsLike(d, l->d) || !endsLike(d, l->d));
+				} else PUSH(l->to, l->d->dstStage);
+			}
+			while(stkcnt > 0 && !found && work < REDUCE_WORK) {
+				reach r = stk[--stkcnt];
+				for(size_t k = first[r.at]; k < first[r.at+1]
+					&& out[k].to <= v && work < REDUCE_WORK; k++, work++) {
+					const link* l = &out[k];
+					if(!(r.stages & l->d->srcStage)
+						|| (regionFlags(l->d) & ~d->flags)) continue;
+					if(l->to == v) {
+						if((found = endsLike(l->d, d))) break;
+					} else if(l->to > r.at)
+						PUSH(l->to, l->d->dstStage);
 				}
 			}
-			if(needsus) break;
+			if(found) implied[id] = 1, dropped++;
 		}
-		if(!needsus) { // If it doesn't need to come after, does it come before?
-			for(int i=0; i < sp->depends.cnt; i++)
-				if(sp->depends.data[i].step == here)
-					missing--;
-			here = here->next;
-		} else {
-			VvVkP_Step* piece = here;
-			here = here->next;
-			if(piece->next) piece->next->prev = piece->prev;
-			else g->steps.end = piece->prev;
-			if(piece->prev) piece->prev->next = piece->next;
-			else g->steps.begin = piece->next;
-
-			// Move after to the end of the "allafter" l-list
-			strip.end->next = piece;
-			piece->prev = strip.end;
-			piece->next = NULL;
-			strip.end = piece;
+	}
+	#undef PUSH
+	free(stk);
+	free(seen);
+	free(stamp);
+	free(out);
+	free(first);
+
+	// Move the live ones to the front
+	id = 0;
+	for(size_t v=0; v < n; v++) {
+		VvVkP_Step* sp = g->order.data[v];
+		int live = 0;
+		for(int j=0; j < sp->depends.cnt; j++)
+			if(!implied[id+j]) live++;
+		VvVkP_Dependency tmp[sp->depends.cnt ? sp->depends.cnt : 1];
+		int a = 0, b = live;
+		for(int j=0; j < sp->depends.cnt; j++)
+			tmp[implied[id+j] ? b++ : a++] = sp->depends.data[j];
+		if(sp->depends.cnt > 0)
+			memcpy(sp->depends.data, tmp, sizeof(tmp));
+		sp->depends.live = live;
+		id += sp->depends.cnt;
+	}
+	free(implied);
+	return dropped;
+}
+
+// Whether Step <a> uses State <st>.
+static int uses(const VvVkP_Step* a, const VvVkP_State* st) {
+	for(int i=0; i < a->stats.cnt; i++)
+		if(a->stats.data[i] == st) return 1;
+	return 0;
+}
+
+// The number of States that change between <a> (NULL for none) and <b>.
+static size_t stateDiff(const VvVkP_Step* a, const VvVkP_Step* b) {
+	size_t d = 0;
+	if(a) for(int i=0; i < a->stats.cnt; i++)
+		if(!uses(b, a->stats.data[i])) d++;
+	for(int i=0; i < b->stats.cnt; i++)
+		if(!a || !uses(a, b->stats.data[i])) d++;
+	return d;
+}
+
+// Number the different sets of States used by the <n> Steps in <list>, so
+// that Steps with the same States are the same kind. The kinds are returned
+// by index, and their count in <kinds>.
+static size_t* groupStates(size_t n, VvVkP_Step** list, size_t* kinds) {
+	size_t sz = 16;
+	while(sz < 2*n) sz *= 2;
+	size_t* table = malloc(sz*sizeof(size_t));	// Step index for a kind
+	for(size_t i=0; i < sz; i++) table[i] = SIZE_MAX;
+	size_t* kind = malloc((n ? n : 1)*sizeof(size_t));
+	*kinds = 0;
+	for(size_t i=0; i < n; i++) {
+		// Add up the States' hashes, so their order doesn't matter
+		uint64_t h = 0;
+		for(int j=0; j < list[i]->stats.cnt; j++) {
+			uint64_t x = (uintptr_t)list[i]->stats.data[j];
+			x ^= x >> 33;
+			x *= 0xff51afd7ed558ccdull;
+			h += x ^ (x >> 29);
 		}
+		size_t at = h & (sz-1);
+		while(table[at] != SIZE_MAX
+			&& stateDiff(list[table[at]], list[i]) != 0)
+			at = (at+1) & (sz-1);
+		if(table[at] == SIZE_MAX) {
+			table[at] = i;
+			kind[i] = (*kinds)++;
+		} else kind[i] = kind[table[at]];
 	}
-	if(missing > 0) {
-		fprintf(stderr, "Error in insert!\n");
-		return;
+	free(table);
+	return kind;
+}
+
+// Fill in g->bits for the <n> Steps in g->order.
+static void noteStates(VvVkP_Graph* g, size_t n) {
+	size_t cnt = 0;
+	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
+		st->bit = cnt++;
+	size_t words = (cnt + 63) / 64;
+	g->bits.words = words;
+	g->bits.data = realloc(g->bits.data, (n*words > 0 ? n*words : 1)
+		*sizeof(uint64_t));
+	g->bits.bound = realloc(g->bits.bound, (words ? words : 1)
+		*sizeof(uint64_t));
+	g->bits.cur = realloc(g->bits.cur, (words ? words : 1)
+		*sizeof(uint64_t));
+	g->bits.stats = realloc(g->bits.stats, (cnt ? cnt : 1)
+		*sizeof(VvVkP_State*));
+	memset(g->bits.data, 0, n*words*sizeof(uint64_t));
+	memset(g->bits.bound, 0, words*sizeof(uint64_t));
+	for(VvVkP_State* st = g->stats.begin; st; st = st->next) {
+		g->bits.stats[st->bit] = st;
+		if(st->bound) g->bits.bound[st->bit/64] |= 1ull << st->bit%64;
+	}
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		uint64_t* b = &g->bits.data[i*words];
+		for(int j=0; j < sp->stats.cnt; j++)
+			b[sp->stats.data[j]->bit/64] |= 1ull << sp->stats.data[j]->bit%64;
+	}
+}
+
+// Kahn's algorithm over the Steps' dependencies, linear in the size of the
+// Graph (plus the heaps, and a look over the ready kinds of Step whenever
+// the States change). Fills in g->order.
+static void sortSteps(VvVkP_Graph* g) {
+	if(g->order.valid) return;
+	size_t n = g->steps.cnt, e = 0;
+	VvVkP_Step** list = malloc(n*sizeof(VvVkP_Step*));
+	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next) {
+		sp->index = e;
+		list[e++] = sp;
 	}
-	if(here == NULL) {	// i.e. we reached the end
-		if(g->steps.end) g->steps.end->next = strip.begin;
-		strip.begin->prev = g->steps.end;
-		strip.end->next = NULL;
-		g->steps.end = strip.end;
-		if(!g->steps.begin) g->steps.begin = strip.begin;	// If empty...
-	} else if(here == g->steps.begin) {	// i.e. we just began
-		here->prev = strip.end;
-		strip.end->next = here;
-		strip.begin->prev = NULL;
-		g->steps.begin = strip.begin;
-	} else {	// Somewhere in the middle
-		strip.begin->prev = here->prev;
-		here->prev->next = strip.begin;
-		strip.end->next = here;
-		here->prev = strip.end;
+
+	// Flip the dependencies around, into a list of the Steps after each.
+	size_t* first = calloc(n+1, sizeof(size_t));
+	e = 0;
+	for(size_t i=0; i < n; i++) {
+		list[i]->waiting = list[i]->depends.cnt;
+		for(int j=0; j < list[i]->depends.cnt; j++)
+			first[list[i]->depends.data[j].step->index + 1]++;
+		e += list[i]->depends.cnt;
+	}
+	for(size_t i=0; i < n; i++) first[i+1] += first[i];
+	size_t* after = malloc(e*sizeof(size_t));
+	size_t* fill = malloc(n*sizeof(size_t));
+	memcpy(fill, first, n*sizeof(size_t));
+	for(size_t i=0; i < n; i++)
+		for(int j=0; j < list[i]->depends.cnt; j++)
+			after[fill[list[i]->depends.data[j].step->index]++] = i;
+
+	// Steps with the same States are kept in a heap each, and the ones that
+	// are ready go one after another, since that's free. Otherwise the
+	// next Step is the one that changes the fewest States.
+	size_t kinds;
+	size_t* kind = groupStates(n, list, &kinds);
+	size_t* heap = fill;	// One per kind, in the order of the kinds
+	size_t* hfirst = calloc(kinds+1, sizeof(size_t));
+	size_t* hcnt = calloc(kinds, sizeof(size_t));
+	size_t* rep = malloc(kinds*sizeof(size_t));	// A Step of the kind
+	for(size_t i=0; i < n; i++) {
+		hfirst[kind[i]+1]++;
+		rep[kind[i]] = i;
+	}
+	for(size_t k=0; k < kinds; k++) hfirst[k+1] += hfirst[k];
+	size_t* active = malloc(kinds*sizeof(size_t));	// Kinds that are ready
+	size_t actcnt = 0;
+	#define READY(I) do { \
+		size_t k_ = kind[I]; \
+		if(hcnt[k_] == 0) active[actcnt++] = k_; \
+		heapPush(&heap[hfirst[k_]], &hcnt[k_], I); \
+	} while(0)
+
+	g->order.data = realloc(g->order.data, n*sizeof(VvVkP_Step*));
+	size_t cnt = 0, cur = SIZE_MAX;
+	for(size_t i=0; i < n; i++)
+		if(list[i]->waiting == 0) READY(i);
+	while(actcnt > 0 || (cur != SIZE_MAX && hcnt[cur] > 0)) {
+		if(cur == SIZE_MAX || hcnt[cur] == 0) {
+			size_t best = 0, bestdiff = SIZE_MAX;
+			for(size_t a=0; a < actcnt; a++) {
+				size_t k = active[a];
+				size_t d = stateDiff(cur == SIZE_MAX ? NULL
+					: list[rep[cur]], list[rep[k]]);
+				if(d < bestdiff || (d == bestdiff
+					&& heap[hfirst[k]] < heap[hfirst[active[best]]])) {
+					best = a;
+					bestdiff = d;
+				}
+			}
+			cur = active[best];
+			active[best] = active[--actcnt];
+		}
+		size_t i = heapPop(&heap[hfirst[cur]], &hcnt[cur]);
+		g->order.data[cnt++] = list[i];
+		for(size_t j = first[i]; j < first[i+1]; j++)
+			if(--list[after[j]]->waiting == 0) {
+				// The current kind isn't in active, it's being drained
+				if(kind[after[j]] == cur)
+					heapPush(&heap[hfirst[cur]], &hcnt[cur], after[j]);
+				else READY(after[j]);
+			}
 	}
+	#undef READY
+	free(kind);
+	free(hfirst);
+	free(hcnt);
+	free(rep);
+	free(active);
+	if(cnt < n) {
+		// Whatever is left is part of a cycle. Keep it, at the end.
+		fprintf(stderr, "Cycle in RenderGraph!\n");
+		for(size_t i=0; i < n; i++)
+			if(list[i]->waiting > 0) g->order.data[cnt++] = list[i];
+	}
+	partition(g, n, list, first, after);
+	for(size_t i=0; i < n; i++) g->order.data[i]->pos = i;
+	g->counts.implied = reduce(g, n);
+	noteStates(g, n);
+	g->plan.valid = 0;
+	free(list);
+	free(first);
+	free(after);
+	free(heap);
+	g->order.valid = 1;
 }
 
 static VvVkP_Step* addSp(const Vv* V, VvVkP_Graph* g, void* udata, int second,
@@ -204,7 +808,7 @@ static VvVkP_Step* addSp(const Vv* V, VvVkP_Graph* g, void* udata, int second,
 			sp->depends.data[i] = *ds[i];
 	}
 
-	insert(g, sp);
+	append(g, sp);
 	return sp;
 }
 
@@ -213,27 +817,320 @@ static void rmSp(const Vv* V, VvVkP_Graph* g, VvVkP_Step* sp) {
 	if(sp == g->steps.end) g->steps.end = sp->prev;
 	if(sp->prev) sp->prev->next = sp->next;
 	if(sp->next) sp->next->prev = sp->prev;
+	g->steps.cnt--;
+	g->order.valid = 0;
+
+	// Nothing may point at it afterwards, so each Dependency on it is
+	// replaced by ones on what it depended on, to keep the order it implied.
+	for(VvVkP_Step* o = g->steps.begin; o; o = o->next) {
+		int m = 0;
+		for(int i=0; i < o->depends.cnt; i++)
+			if(o->depends.data[i].step == sp) m++;
+		if(m == 0) continue;
+		int cnt = o->depends.cnt - m + m*sp->depends.cnt;
+		VvVkP_Dependency* ds = malloc((cnt ? cnt : 1)*sizeof(VvVkP_Dependency));
+		int k = 0;
+		for(int i=0; i < o->depends.cnt; i++) {
+			const VvVkP_Dependency* d = &o->depends.data[i];
+			if(d->step != sp) {
+				ds[k++] = *d;
+				continue;
+			}
+			for(int j=0; j < sp->depends.cnt; j++) {
+				const VvVkP_Dependency* e = &sp->depends.data[j];
+				if(e->step == sp || e->step == o) continue;
+				ds[k] = (VvVkP_Dependency){
+					.step = e->step,
+					.srcStage = e->srcStage, .srcAccess = e->srcAccess,
+					.dstStage = d->dstStage, .dstAccess = d->dstAccess,
+					.flags = e->flags & d->flags,
+				};
+				if(e->attachmentEnable && d->attachmentEnable
+					&& sameMemory(e, d)) {
+					ds[k].attachmentEnable = 1;
+					ds[k].attachment = e->attachment;
+					ds[k].attachmentRange = e->attachmentRange;
+				}
+				k++;
+			}
+		}
+		free(o->depends.data);
+		o->depends.data = ds;
+		o->depends.cnt = o->depends.live = k;
+	}
+	if(sp->cb) vVvk_FreeCommandBuffers(g->cache.dev, g->cache.pool, 1, &sp->cb);
 	FREE_SP(sp);
 }
 
 static void depends(const Vv* V, VvVkP_Graph* g, VvVkP_Step* sp,
 	size_t dc, VvVkP_Dependency** ds) {
 
-	// First, we take the Step out of the list
-	if(sp == g->steps.begin) g->steps.begin = sp->next;
-	if(sp == g->steps.end) g->steps.end = sp->prev;
-	if(sp->prev) sp->prev->next = sp->next;
-	if(sp->next) sp->next->prev = sp->prev;
-
-	// Then we expand depends.data
+	// Expand depends.data, the Steps will be sorted again when needed
 	sp->depends.data = realloc(sp->depends.data,
 		(dc + sp->depends.cnt)*sizeof(VvVkP_Dependency));
 	for(int i=0; i<dc; i++)
 		sp->depends.data[i+sp->depends.cnt] = *ds[i];
 	sp->depends.cnt += dc;
+	g->order.valid = 0;
+}
+
+// A barrier that has been planned, which covers the Steps before
+// g->order.data[at] (so 0 is none).
+typedef struct {
+	size_t at;
+	VkPipelineStageFlags src, dst;
+	VkDependencyFlags flags;
+	VkAccessFlags srcAccess, dstAccess;
+	VkImageSubresourceRange range;
+} covered;
+
+static int covers(const covered* c, const VvVkP_Dependency* d) {
+	return c->at > d->step->pos
+		&& !(d->srcStage & ~c->src) && !(d->dstStage & ~c->dst)
+		&& !(c->flags & ~d->flags)
+		&& !(d->srcAccess & ~c->srcAccess)
+		&& !(d->dstAccess & ~c->dstAccess);
+}
+
+static void addTrans(VvVkP_Graph* g, void* udata, int set) {
+	if(g->plan.transcnt == g->plan.transmax) {
+		g->plan.transmax = g->plan.transmax ? 2*g->plan.transmax : 16;
+		g->plan.trans = realloc(g->plan.trans,
+			g->plan.transmax*sizeof(planTrans));
+	}
+	g->plan.trans[g->plan.transcnt++] = (planTrans){udata, set};
+	if(set) g->counts.sets++;
+	else g->counts.unsets++;
+}
+
+// Plan the dependencies of <sp> that are within its subpass (the ones
+// between subpasses are part of the RenderPass) as one barrier in <op>.
+// Ones that an earlier barrier in <mem> or <att> already covers are skipped.
+static void planDeps(VvVkP_Graph* g, const VvVkP_Step* sp, planStep* op,
+	covered* mem, covered* att) {
+
+	if(sp->depends.live == 0) return;
+	if(g->plan.imgcnt + sp->depends.live > g->plan.imgmax) {
+		g->plan.imgmax = 2*(g->plan.imgcnt + sp->depends.live);
+		g->plan.imgs = realloc(g->plan.imgs,
+			g->plan.imgmax*sizeof(VkImageMemoryBarrier));
+		g->plan.atts = realloc(g->plan.atts,
+			g->plan.imgmax*sizeof(uint32_t));
+	}
+	VkImageMemoryBarrier* ibs = &g->plan.imgs[g->plan.imgcnt];
+	uint32_t* ats = &g->plan.atts[g->plan.imgcnt];
+	const VkImageLayout* ls = g->layouts && sp->subpass < g->layoutsubs
+		? &g->layouts[sp->subpass*g->attachcnt] : NULL;
+	VkDependencyFlags flags = ~0;
+	VkMemoryBarrier mb = {VK_STRUCTURE_TYPE_MEMORY_BARRIER, NULL, 0, 0};
+	for(int i=0; i < sp->depends.live; i++) {
+		const VvVkP_Dependency* d = &sp->depends.data[i];
+		if(d->step->subpass != sp->subpass) continue;
+		g->counts.dependencies++;
+		if(covers(mem, d)) continue;
+		if(d->attachmentEnable) {
+			// Coverage is only tracked for attachments compile knew of
+			const covered* a = d->attachment < g->attachcnt
+				? &att[d->attachment] : NULL;
+			if(a && covers(a, d) && sameRange(&a->range, &d->attachmentRange))
+				continue;
+			int j = 0;
+			while(j < op->imgcnt && !(ats[j] == d->attachment
+				&& sameRange(&ibs[j].subresourceRange,
+					&d->attachmentRange))) j++;
+			if(j == op->imgcnt) {
+				// The Image is filled in by record. Without a compile
+				// there are no layouts, so GENERAL is the best guess.
+				VkImageLayout l = ls && d->attachment < g->attachcnt
+					? ls[d->attachment] : VK_IMAGE_LAYOUT_GENERAL;
+				ibs[op->imgcnt++] = (VkImageMemoryBarrier){
+					VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER, NULL,
+					0, 0, l, l,
+					VK_QUEUE_FAMILY_IGNORED, VK_QUEUE_FAMILY_IGNORED,
+					VK_NULL_HANDLE, d->attachmentRange,
+				};
+				ats[j] = d->attachment;
+			}
+			ibs[j].srcAccessMask |= d->srcAccess;
+			ibs[j].dstAccessMask |= d->dstAccess;
+		} else {
+			mb.srcAccessMask |= d->srcAccess;
+			mb.dstAccessMask |= d->dstAccess;
+			op->memcnt = 1;
+		}
+		op->src |= d->srcStage;
+		op->dst |= d->dstStage;
+		flags &= d->flags;
+	}
+	if(!op->memcnt && !op->imgcnt) return;
+	op->flags = flags;
+	op->mem = mb;
+	op->img = g->plan.imgcnt;
+	g->plan.imgcnt += op->imgcnt;
+	g->counts.barriers++;
+
+	// Note down what this one covers, for the Steps after
+	if(op->memcnt) *mem = (covered){sp->pos, op->src, op->dst, flags,
+		mb.srcAccessMask, mb.dstAccessMask};
+	for(uint32_t j=0; j < op->imgcnt; j++)
+		if(ats[j] < g->attachcnt)
+			att[ats[j]] = (covered){sp->pos, op->src, op->dst, flags,
+				ibs[j].srcAccessMask, ibs[j].dstAccessMask,
+				ibs[j].subresourceRange};
+}
+
+// Work out everything record does for the Graph as it is now, so that it
+// only has to walk through g->plan.
+static void makePlan(VvVkP_Graph* g) {
+	sortSteps(g);
+	size_t n = g->steps.cnt, words = g->bits.words;
+	g->plan.steps = realloc(g->plan.steps, (n ? n : 1)*sizeof(planStep));
+	g->plan.imgcnt = g->plan.transcnt = 0;
+	g->counts.dependencies = g->counts.barriers = 0;
+	g->counts.sets = g->counts.unsets = 0;
+	uint64_t* cur = g->bits.cur;
+	memset(cur, 0, words*sizeof(uint64_t));
+	covered mem = {0};
+	covered* att = calloc(g->attachcnt ? g->attachcnt : 1, sizeof(covered));
+	uint32_t sub = 0;
+	for(size_t i=0; i < n; i++) {
+		VvVkP_Step* sp = g->order.data[i];
+		planStep* op = &g->plan.steps[i];
+		*op = (planStep){.step = sp, .udata = sp->udata,
+			.trans = g->plan.transcnt};
+
+		// Move on to the Step's subpass. Bound States don't carry over.
+		if(sp->subpass != sub) {
+			for(size_t w=0; w < words; w++) {
+				uint64_t x = cur[w] & g->bits.bound[w];
+				cur[w] &= ~x;
+				for(; x; x &= x-1, op->pre++) addTrans(g,
+					g->bits.stats[w*64 + __builtin_ctzll(x)]->udata, 0);
+			}
+			op->next = sp->subpass - sub;
+			sub = sp->subpass;
+			mem.at = 0;
+			memset(att, 0, g->attachcnt*sizeof(covered));
+		}
+
+		planDeps(g, sp, op, &mem, att);
+
+		// A cached cb is only good for the same subpass and barrier.
+		// Image barriers get their Images back in record, so those
+		// are recorded again anyway.
+		if(!sp->cb || op->imgcnt > 0 || sp->planned.subpass != sp->subpass
+			|| sp->planned.src != op->src || sp->planned.dst != op->dst
+			|| sp->planned.flags != op->flags
+			|| sp->planned.srcAccess != op->mem.srcAccessMask
+			|| sp->planned.dstAccess != op->mem.dstAccessMask)
+			sp->dirty = 1;
+		sp->planned.subpass = sp->subpass;
+		sp->planned.src = op->src;
+		sp->planned.dst = op->dst;
+		sp->planned.flags = op->flags;
+		sp->planned.srcAccess = op->mem.srcAccessMask;
+		sp->planned.dstAccess = op->mem.dstAccessMask;
+
+		// Get the States right, only the ones that differ need a look
+		const uint64_t* want = &g->bits.data[i*words];
+		for(size_t w=0; w < words; w++) {
+			for(uint64_t x = cur[w] ^ want[w]; x; x &= x-1, op->post++) {
+				int b = __builtin_ctzll(x);
+				addTrans(g, g->bits.stats[w*64 + b]->udata,
+					want[w] >> b & 1);
+			}
+			cur[w] = want[w];
+		}
+	}
+
+	// And unset all the extra States at the end
+	g->plan.last = g->plan.transcnt;
+	for(size_t w=0; w < words; w++)
+		for(uint64_t x = cur[w]; x; x &= x-1)
+			addTrans(g, g->bits.stats[w*64 + __builtin_ctzll(x)]->udata, 0);
+	free(att);
+	g->plan.valid = 1;
+}
+
+// A growing buffer of bytes, for the key of a RenderPass.
+typedef struct {
+	unsigned char* data;
+	size_t size, max;
+} passKey;
 
-	// Then we add it back in (slight issue, fix later)
-	insert(g, sp);
+static void keyAdd(passKey* k, const void* data, size_t size) {
+	if(size == 0) return;
+	if(k->size + size > k->max) {
+		k->max = 2*(k->size + size);
+		k->data = realloc(k->data, k->max);
+	}
+	memcpy(&k->data[k->size], data, size);
+	k->size += size;
+}
+
+static void keyRefs(passKey* k, uint32_t cnt,
+	const VkAttachmentReference* refs) {
+	keyAdd(k, &cnt, sizeof(uint32_t));
+	if(refs) keyAdd(k, refs, cnt*sizeof(VkAttachmentReference));
+}
+
+// Everything that goes into a RenderPass, with the pointers followed.
+static void makeKey(passKey* k, uint32_t aCnt,
+	const VkAttachmentDescription* as, uint32_t nsub,
+	const VkSubpassDescription* sds, uint32_t depcnt,
+	const VkSubpassDependency* deps) {
+
+	keyAdd(k, &aCnt, sizeof(uint32_t));
+	keyAdd(k, as, aCnt*sizeof(VkAttachmentDescription));
+	keyAdd(k, &nsub, sizeof(uint32_t));
+	for(uint32_t i=0; i < nsub; i++) {
+		const VkSubpassDescription* sd = &sds[i];
+		uint32_t has[2] = {sd->pResolveAttachments != NULL,
+			sd->pDepthStencilAttachment != NULL};
+		keyAdd(k, &sd->flags, sizeof(VkSubpassDescriptionFlags));
+		keyAdd(k, &sd->pipelineBindPoint, sizeof(VkPipelineBindPoint));
+		keyAdd(k, has, sizeof has);
+		keyRefs(k, sd->inputAttachmentCount, sd->pInputAttachments);
+		keyRefs(k, sd->colorAttachmentCount, sd->pColorAttachments);
+		if(has[0])
+			keyRefs(k, sd->colorAttachmentCount, sd->pResolveAttachments);
+		if(has[1]) keyRefs(k, 1, sd->pDepthStencilAttachment);
+		keyAdd(k, &sd->preserveAttachmentCount, sizeof(uint32_t));
+		keyAdd(k, sd->pPreserveAttachments,
+			sd->preserveAttachmentCount*sizeof(uint32_t));
+	}
+	keyAdd(k, &depcnt, sizeof(uint32_t));
+	keyAdd(k, deps, depcnt*sizeof(VkSubpassDependency));
+}
+
+// FNV-1a, which is plenty for the handful of RenderPasses a Graph has.
+static uint64_t hashKey(const passKey* k) {
+	uint64_t h = 14695981039346656037ull;
+	for(size_t i=0; i < k->size; i++) {
+		h ^= k->data[i];
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+// Destroy the RenderPasses that <keep> records have gone by without.
+static void retirePasses(VvVkP_Graph* g) {
+	for(size_t i=0; i < g->passes.cnt;) {
+		cachedPass* p = &g->passes.data[i];
+		if(p->rpass == g->rpass
+			|| g->passes.frame - p->used < g->passes.keep) {
+			i++;
+			continue;
+		}
+		g->drpass(g->dev, p->rpass, NULL);
+		free(p->key);
+		*p = g->passes.data[--g->passes.cnt];
+	}
+}
+
+static void noteLayout(VkImageLayout* ls, size_t aCnt,
+	const VkAttachmentReference* r) {
+	if(r->attachment < aCnt) ls[r->attachment] = r->layout;
 }
 
 static VkRenderPass getRP(const Vv* V, VvVkP_Graph* g, VkDevice dev,
@@ -241,23 +1138,29 @@ static VkRenderPass getRP(const Vv* V, VvVkP_Graph* g, VkDevice dev,
 	VkSubpassDescription (*spass)(void*,size_t,void**,size_t,void**),
 	void* spass_ud, VkResult* rs) {
 
-	// Destroy the old RenderPass
-	if(g->rpass) g->drpass(g->dev, g->rpass, NULL);
-
-	// Get a contiguous array of Steps and dependencies
-	int depcnt = 0, spcnt = 0;
-	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next) {
-		spcnt++;
-		depcnt += sp->depends.cnt;
+	// RenderPasses for another Device are no good to anyone
+	if(g->passes.cnt > 0 && dev != g->dev) {
+		size_t keep = g->passes.keep;
+		g->rpass = VK_NULL_HANDLE;
+		g->passes.keep = 0;
+		retirePasses(g);
+		g->passes.keep = keep;
 	}
-	void** sps = malloc(spcnt*sizeof(void*));
+
+	// Get a contiguous array of dependencies
+	sortSteps(g);
+	uint32_t nsub = g->spasscnt;
+	int depcnt = 0;
+	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next)
+		depcnt += sp->depends.live;
 	VkSubpassDependency* deps = malloc(depcnt*sizeof(VkSubpassDependency));
-	spcnt = 0; depcnt = 0;
-	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next) {
-		sps[spcnt++] = sp;
-		for(int i=0; i < sp->depends.cnt; i++) {
+	depcnt = 0;
+	for(size_t n=0; n < g->steps.cnt; n++) {
+		VvVkP_Step* sp = g->order.data[n];
+		for(int i=0; i < sp->depends.live; i++) {
 			deps[depcnt++] = (VkSubpassDependency){
-				.srcSubpass = 0, .dstSubpass = 0,
+				.srcSubpass = sp->depends.data[i].step->subpass,
+				.dstSubpass = sp->subpass,
 				.srcStageMask = sp->depends.data[i].srcStage,
 				.dstStageMask = sp->depends.data[i].dstStage,
 				.srcAccessMask = sp->depends.data[i].srcAccess,
@@ -269,156 +1172,506 @@ static VkRenderPass getRP(const Vv* V, VvVkP_Graph* g, VkDevice dev,
 		}
 	}
 
-	// Get a contiguous array of bound States
+	// Get the description for each subpass, from its Steps and bound States
 	int stcnt = 0;
 	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
-		if(st->bound) stcnt++;
+		stcnt++;
+	void** sps = malloc(g->steps.cnt*sizeof(void*));
 	void** sts = malloc(stcnt*sizeof(void*));
-	stcnt = 0;
-	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
-		if(st->bound) sts[stcnt++] = st;
-
-	// Get the description for the only subpass
-	VkSubpassDescription sd = spass(spass_ud, spcnt, sps, stcnt, sts);
+	VkSubpassDescription* sds = malloc(nsub*sizeof(VkSubpassDescription));
+	size_t at = 0;
+	for(uint32_t k=0; k < nsub; k++) {
+		size_t spcnt = 0;
+		for(; at < g->steps.cnt && g->order.data[at]->subpass == k; at++)
+			sps[spcnt++] = g->order.data[at]->udata;
+		stcnt = 0;
+		for(VvVkP_State* st = g->stats.begin; st; st = st->next)
+			if(st->bound && st->subpass == k) sts[stcnt++] = st->udata;
+		sds[k] = spass(spass_ud, spcnt, sps, stcnt, sts);
+	}
 	free(sps);
 	free(sts);
+
+	// Save the layouts each subpass uses the attachments in
 	if(g->layouts) free(g->layouts);
-	g->layouts = calloc(aCnt, sizeof(VkImageLayout));
-	for(int i=0; i<sd.inputAttachmentCount; i++)
-		g->layouts[sd.pInputAttachments[i].attachment]
-			= sd.pInputAttachments[i].layout;
-	for(int i=0; i<sd.colorAttachmentCount; i++) {
-		g->layouts[sd.pColorAttachments[i].attachment]
-			= sd.pColorAttachments[i].layout;
-		if(sd.pResolveAttachments)
-			g->layouts[sd.pResolveAttachments[i].attachment]
-				= sd.pResolveAttachments[i].layout;
-	}
-	if(sd.pDepthStencilAttachment)
-		g->layouts[sd.pDepthStencilAttachment->attachment]
-			= sd.pDepthStencilAttachment->layout;
-
-	// Make the RenderPass
+	g->layouts = calloc(nsub*aCnt, sizeof(VkImageLayout));
+	g->attachcnt = aCnt;
+	g->layoutsubs = nsub;
+	for(uint32_t k=0; k < nsub; k++) {
+		VkSubpassDescription* sd = &sds[k];
+		VkImageLayout* ls = &g->layouts[k*aCnt];
+		for(int i=0; i<sd->inputAttachmentCount; i++)
+			noteLayout(ls, aCnt, &sd->pInputAttachments[i]);
+		for(int i=0; i<sd->colorAttachmentCount; i++) {
+			noteLayout(ls, aCnt, &sd->pColorAttachments[i]);
+			if(sd->pResolveAttachments)
+				noteLayout(ls, aCnt, &sd->pResolveAttachments[i]);
+		}
+		if(sd->pDepthStencilAttachment)
+			noteLayout(ls, aCnt, sd->pDepthStencilAttachment);
+	}
+
+	// Attachments used both before and after a subpass that doesn't use
+	// them have to be preserved through it, unless <spass> said otherwise.
+	uint32_t* preserve = malloc(nsub*aCnt*sizeof(uint32_t));
+	for(uint32_t k=0; k < nsub; k++)
+		if(sds[k].preserveAttachmentCount == 0)
+			sds[k].pPreserveAttachments = &preserve[k*aCnt];
+	for(size_t a=0; a < aCnt; a++) {
+		uint32_t first = nsub, last = 0;
+		for(uint32_t k=0; k < nsub; k++)
+			if(g->layouts[k*aCnt + a] != VK_IMAGE_LAYOUT_UNDEFINED) {
+				if(first == nsub) first = k;
+				last = k;
+			}
+		for(uint32_t k = first+1; k < last; k++)
+			if(g->layouts[k*aCnt + a] == VK_IMAGE_LAYOUT_UNDEFINED
+				&& sds[k].pPreserveAttachments == &preserve[k*aCnt])
+				preserve[k*aCnt + sds[k].preserveAttachmentCount++] = a;
+	}
+
+	// Plan out the recording while we're at it
+	makePlan(g);
+
+	// Use the RenderPass from before if there is one, otherwise make it
+	passKey k = {NULL, 0, 0};
+	makeKey(&k, aCnt, as, nsub, sds, depcnt, deps);
+	uint64_t h = hashKey(&k);
+	cachedPass* p = NULL;
+	for(size_t i=0; i < g->passes.cnt; i++)
+		if(g->passes.data[i].hash == h && g->passes.data[i].size == k.size
+			&& memcmp(g->passes.data[i].key, k.data, k.size) == 0) {
+			p = &g->passes.data[i];
+			free(k.data);
+			break;
+		}
+	VkResult r = VK_SUCCESS;
 	g->dev = dev;
 	g->drpass = V->vk->cmds->core->DestroyRenderPass;
-	VkResult r = vVvk_CreateRenderPass(dev, &(VkRenderPassCreateInfo){
-		VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO, NULL, 0,
-		aCnt, as,
-		1, &sd,
-		depcnt, deps,
-	}, NULL, &(g->rpass));
+	if(p) g->rpass = p->rpass;
+	else {
+		r = vVvk_CreateRenderPass(dev, &(VkRenderPassCreateInfo){
+			VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO, NULL, 0,
+			aCnt, as,
+			nsub, sds,
+			depcnt, deps,
+		}, NULL, &(g->rpass));
+		if(r<0) {
+			g->rpass = VK_NULL_HANDLE;
+			free(k.data);
+		} else {
+			if(g->passes.cnt == g->passes.max) {
+				g->passes.max = g->passes.max ? 2*g->passes.max : 4;
+				g->passes.data = realloc(g->passes.data,
+					g->passes.max*sizeof(cachedPass));
+			}
+			p = &g->passes.data[g->passes.cnt++];
+			*p = (cachedPass){h, k.data, k.size, g->rpass};
+		}
+	}
+	if(p) p->used = g->passes.frame;
+	retirePasses(g);
 	free(deps);
+	free(sds);
+	free(preserve);
 	if(r<0) {
-		g->rpass = VK_NULL_HANDLE;
 		if(rs) *rs = r;
 		return VK_NULL_HANDLE;
 	} else return g->rpass;
 }
 
+static void keepPasses(const Vv* V, VvVkP_Graph* g, size_t frames) {
+	g->passes.keep = frames;
+	retirePasses(g);
+}
+
 static size_t getSts(const Vv* V, VvVkP_Graph* g, void** udata, int* spasses) {
+	sortSteps(g);
 	int cnt = 0;
 	for(VvVkP_State* st = g->stats.begin; st; st=st->next) {
 		if(udata) udata[cnt] = st->udata;
-		if(spasses) spasses[cnt] = 0;
+		if(spasses) spasses[cnt] = st->subpass;
 		cnt++;
 	}
 	return cnt;
 }
 
+static const VvVkP_Counts* getCnts(const Vv* V, VvVkP_Graph* g) {
+	return &g->counts;
+}
+
 static size_t getSps(const Vv* V, VvVkP_Graph* g, void** udata) {
-	int cnt = 0;
+	sortSteps(g);
+	if(udata)
+		for(size_t i=0; i < g->steps.cnt; i++)
+			udata[i] = g->order.data[i]->udata;
+	return g->steps.cnt;
+}
+
+static VkResult setCache(const Vv* V, VvVkP_Graph* g, VkDevice dev,
+	uint32_t family) {
+
+	if(g->second == 0) return VK_ERROR_FEATURE_NOT_PRESENT;
+	g->second = 1;
+
+	// Start over with a new pool, the old CommandBuffers go with the old one
+	if(g->cache.pool) {
+		vVvk_DestroyCommandPool(g->cache.dev, g->cache.pool, NULL);
+		g->cache.pool = VK_NULL_HANDLE;
+	}
 	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next) {
-		if(udata) udata[cnt] = sp->udata;
-		cnt++;
+		sp->cb = NULL;
+		sp->dirty = 1;
 	}
-	return cnt;
+	g->cache.dev = dev;
+	g->cache.rpass = VK_NULL_HANDLE;
+	return vVvk_CreateCommandPool(dev, &(VkCommandPoolCreateInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		.queueFamilyIndex = family,
+	}, NULL, &g->cache.pool);
 }
 
-static void rec(const Vv* V, VvVkP_Graph* g,
-	VkCommandBuffer cbuff, VkRenderPassBeginInfo* info,
-	VkImage* imgs,
+static void markDirty(const Vv* V, VvVkP_Graph* g, VvVkP_Step* sp) {
+	sp->dirty = 1;
+}
+
+static VkResult setParallel(const Vv* V, VvVkP_Graph* g, VkDevice dev,
+	uint32_t family, int threads) {
+
+	if(g->second == 0) return VK_ERROR_FEATURE_NOT_PRESENT;
+	g->second = 1;
+
+	// The old pools may be for another Device, so they all go
+	for(size_t i=0; i < g->par.made; i++)
+		vVvk_DestroyCommandPool(g->par.dev, g->par.pools[i], NULL);
+	g->par.made = 0;
+	g->par.dev = dev;
+	g->par.family = family;
+	g->par.threads = threads;
+	if(!g->par.workers) g->par.workers = _vVpoolcreate(0);
+	return VK_SUCCESS;
+}
+
+// Record the commands for the Step of <op> into its own CommandBuffer,
+// which can then be executed in <subpass> of <rpass>. Since nothing carries
+// over from the primary, it gets its barrier and all its States set.
+static void recordStep(const Vv* V, VvVkP_Graph* g, const planStep* op,
+	VkRenderPass rpass, uint32_t subpass,
 	void (*set)(void*, void*, VkCommandBuffer), void* set_ud,
-	void (*uset)(void*, void*, VkCommandBuffer), void* uset_ud,
 	void (*cmd)(void*, void*, VkCommandBuffer), void* cmd_ud) {
 
-	int statcnt = 0;
-	for(VvVkP_State* st = g->stats.begin; st; st = st->next)
-		statcnt++;
-	VvVkP_State* stats[statcnt];
-	int setting[statcnt];
-	statcnt = 0;
-	for(VvVkP_State* st = g->stats.begin; st; st = st->next) {
-		stats[statcnt] = st;
-		setting[statcnt] = 0;
-		statcnt++;
+	VvVkP_Step* sp = op->step;
+	if(!sp->cb) vVvk_AllocateCommandBuffers(g->cache.dev,
+		&(VkCommandBufferAllocateInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			.commandPool = g->cache.pool,
+			.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+			.commandBufferCount = 1,
+		}, &sp->cb);
+	vVvk_BeginCommandBuffer(sp->cb, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT
+			| VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT,
+		.pInheritanceInfo = &(VkCommandBufferInheritanceInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+			.renderPass = rpass, .subpass = subpass,
+			.framebuffer = VK_NULL_HANDLE,
+		},
+	});
+	if(op->memcnt || op->imgcnt)
+		vVvk_CmdPipelineBarrier(sp->cb, op->src, op->dst, op->flags,
+			op->memcnt, &op->mem, 0, NULL,
+			op->imgcnt, &g->plan.imgs[op->img]);
+	if(set)
+		for(int i=0; i < sp->stats.cnt; i++)
+			set(set_ud, sp->stats.data[i]->udata, sp->cb);
+	if(cmd) cmd(cmd_ud, sp->udata, sp->cb);
+	vVvk_EndCommandBuffer(sp->cb);
+	sp->dirty = 0;
+	g->counts.sets += sp->stats.cnt;
+	g->counts.recorded++;
+}
+
+// record for a Graph with cached CommandBuffers: only the dirty ones are
+// recorded, and the rest is just executing them.
+static void recCached(const Vv* V, VvVkP_Graph* g,
+	VkCommandBuffer cbuff, VkRenderPassBeginInfo* info, VkImage* imgs,
+	void (*set)(void*, void*, VkCommandBuffer), void* set_ud,
+	void (*cmd)(void*, void*, VkCommandBuffer), void* cmd_ud) {
+
+	// CommandBuffers for another RenderPass are no good
+	if(g->cache.rpass != info->renderPass) {
+		for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next)
+			sp->dirty = 1;
+		g->cache.rpass = info->renderPass;
+	}
+	if(g->cache.cbmax < g->steps.cnt) {
+		g->cache.cbmax = g->steps.cnt;
+		g->cache.cbs = realloc(g->cache.cbs,
+			g->cache.cbmax*sizeof(VkCommandBuffer));
 	}
 
-	// Enter the RenderPass
-	vVvk_CmdBeginRenderPass(cbuff, info,
-		g->second ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
-		: VK_SUBPASS_CONTENTS_INLINE);
+	// Only the Steps recorded now set anything, and nothing is ever unset
+	g->counts.sets = g->counts.unsets = 0;
 
-	for(VvVkP_Step* sp = g->steps.begin; sp; sp = sp->next) {
-		// Record all the dependencies
-		for(int i=0; i < sp->depends.cnt; i++) {
-			VvVkP_Dependency* d = &sp->depends.data[i];
-			if(d->attachmentEnable)
-				vVvk_CmdPipelineBarrier(cbuff,
-					d->srcStage, d->dstStage, d->flags,
-					0, NULL,
-					0, NULL,
-					1, &(VkImageMemoryBarrier){
-						VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-						NULL,
-						d->srcAccess, d->dstAccess,
-						g->layouts[d->attachment],
-						g->layouts[d->attachment],
-						VK_QUEUE_FAMILY_IGNORED,
-						VK_QUEUE_FAMILY_IGNORED,
-						imgs[d->attachment],
-						d->attachmentRange,
-					});
-			else
-				vVvk_CmdPipelineBarrier(cbuff,
-					d->srcStage, d->dstStage, d->flags,
-					1, &(VkMemoryBarrier){
-						VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-						NULL,
-						d->srcAccess, d->dstAccess,
-					},
-					0, NULL,
-					0, NULL);
+	// Steps with barriers on other Images than last time are dirty too
+	for(size_t i=0; i < g->steps.cnt; i++) {
+		const planStep* op = &g->plan.steps[i];
+		for(uint32_t j=0; imgs && j < op->imgcnt; j++) {
+			VkImageMemoryBarrier* ib = &g->plan.imgs[op->img + j];
+			if(ib->image != imgs[g->plan.atts[op->img + j]]) {
+				ib->image = imgs[g->plan.atts[op->img + j]];
+				op->step->dirty = 1;
+			}
+		}
+	}
+
+	vVvk_CmdBeginRenderPass(cbuff, info,
+		VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	uint32_t sub = 0;
+	size_t cbcnt = 0;
+	for(size_t i=0; i < g->steps.cnt; i++) {
+		const planStep* op = &g->plan.steps[i];
+		if(op->next > 0 && cbcnt > 0) {
+			vVvk_CmdExecuteCommands(cbuff, cbcnt, g->cache.cbs);
+			cbcnt = 0;
 		}
+		for(uint32_t j=0; j < op->next; j++, sub++)
+			vVvk_CmdNextSubpass(cbuff,
+				VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+		if(op->step->dirty)
+			recordStep(V, g, op, info->renderPass, sub,
+				set, set_ud, cmd, cmd_ud);
+		g->cache.cbs[cbcnt++] = op->step->cb;
+	}
+	if(cbcnt > 0) vVvk_CmdExecuteCommands(cbuff, cbcnt, g->cache.cbs);
+	vVvk_CmdEndRenderPass(cbuff);
+}
 
-		// Get the States right
-		for(int i=0; i<statcnt; i++) {
-			int shouldbe = 0;
-			for(int j=0; j < sp->stats.cnt; j++) {
-				if(sp->stats.data[j] == stats[i]) {
-					shouldbe = 1;
-					break;
+// Chunks smaller than this aren't worth a CommandBuffer of their own.
+#define CHUNK_MIN 64
+
+typedef struct {
+	const Vv* V;
+	VvVkP_Graph* g;
+	VkRenderPass rpass;
+	void (*set)(void*, void*, VkCommandBuffer);
+	void* set_ud;
+	void (*uset)(void*, void*, VkCommandBuffer);
+	void* uset_ud;
+	void (*cmd)(void*, void*, VkCommandBuffer);
+	void* cmd_ud;
+	size_t* sets;	// Per chunk
+	size_t* usets;
+} chunks;
+
+// Record chunk <c> into its own CommandBuffer. It starts with nothing set,
+// so the first Step gets all its States set, and they're all unset at the
+// end. Everything in between is just as in the plan.
+static void recChunk(void* vc, size_t c) {
+	const chunks* r = vc;
+	const Vv* V = r->V;
+	VvVkP_Graph* g = r->g;
+	size_t first = g->par.starts[c], end = g->par.starts[c+1];
+	size_t words = g->bits.words, sets = 0, usets = 0;
+	VkCommandBuffer cb = g->par.cbs[c];
+
+	vVvk_ResetCommandPool(g->par.dev, g->par.pools[c], 0);
+	vVvk_BeginCommandBuffer(cb, &(VkCommandBufferBeginInfo){
+		.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT
+			| VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT,
+		.pInheritanceInfo = &(VkCommandBufferInheritanceInfo){
+			.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO,
+			.renderPass = r->rpass,
+			.subpass = g->plan.steps[first].step->subpass,
+			.framebuffer = VK_NULL_HANDLE,
+		},
+	});
+	for(size_t i=first; i < end; i++) {
+		const planStep* op = &g->plan.steps[i];
+		if(op->memcnt || op->imgcnt)
+			vVvk_CmdPipelineBarrier(cb, op->src, op->dst, op->flags,
+				op->memcnt, &op->mem, 0, NULL,
+				op->imgcnt, &g->plan.imgs[op->img]);
+		if(i == first) {
+			const uint64_t* want = &g->bits.data[i*words];
+			for(size_t w=0; w < words; w++)
+				for(uint64_t x = want[w]; x; x &= x-1, sets++)
+					if(r->set) r->set(r->set_ud, g->bits.stats[
+						w*64 + __builtin_ctzll(x)]->udata, cb);
+		} else {
+			const planTrans* t = &g->plan.trans[op->trans + op->pre];
+			for(uint32_t j=0; j < op->post; j++, t++) {
+				if(t->set) {
+					sets++;
+					if(r->set) r->set(r->set_ud, t->udata, cb);
+				} else {
+					usets++;
+					if(r->uset) r->uset(r->uset_ud, t->udata, cb);
 				}
 			}
+		}
+		if(r->cmd) r->cmd(r->cmd_ud, op->udata, cb);
+	}
+	const uint64_t* have = &g->bits.data[(end-1)*words];
+	for(size_t w=0; w < words; w++)
+		for(uint64_t x = have[w]; x; x &= x-1, usets++)
+			if(r->uset) r->uset(r->uset_ud, g->bits.stats[
+				w*64 + __builtin_ctzll(x)]->udata, cb);
+	vVvk_EndCommandBuffer(cb);
+	r->sets[c] = sets;
+	r->usets[c] = usets;
+}
 
-			if(shouldbe && !setting[i]) {
-				if(set) set(set_ud, stats[i]->udata, cbuff);
-			} else if(!shouldbe && setting[i]) {
-				if(uset) uset(uset_ud, stats[i]->udata, cbuff);
-			}
-			setting[i] = shouldbe;
+// record for a Graph that records in parallel: the Steps are cut into
+// chunks that each stay within a subpass, the workers record those, and
+// then they're executed in order.
+static void recParallel(const Vv* V, VvVkP_Graph* g,
+	VkCommandBuffer cbuff, VkRenderPassBeginInfo* info, VkImage* imgs,
+	void (*set)(void*, void*, VkCommandBuffer), void* set_ud,
+	void (*uset)(void*, void*, VkCommandBuffer), void* uset_ud,
+	void (*cmd)(void*, void*, VkCommandBuffer), void* cmd_ud) {
+
+	size_t n = g->steps.cnt;
+	g->counts.recorded = n;
+	if(imgs)
+		for(size_t i=0; i < g->plan.imgcnt; i++)
+			g->plan.imgs[i].image = imgs[g->plan.atts[i]];
+
+	// A few chunks per thread, so the ones that finish early can help out
+	int width = g->par.threads > 0 ? g->par.threads
+		: _vVpoolsize(g->par.workers);
+	if(width < 1) width = 1;
+	size_t size = n / (4*width) + 1;
+	if(size < CHUNK_MIN) size = CHUNK_MIN;
+	if(g->par.max < n + 1) {
+		g->par.max = n + 1;
+		g->par.starts = realloc(g->par.starts, g->par.max*sizeof(size_t));
+	}
+	g->par.cnt = 0;
+	for(size_t i=0; i < n; i++)
+		if(i == 0 || g->plan.steps[i].next > 0
+			|| i - g->par.starts[g->par.cnt-1] >= size)
+			g->par.starts[g->par.cnt++] = i;
+	g->par.starts[g->par.cnt] = n;
+
+	if(g->par.made < g->par.cnt) {
+		g->par.pools = realloc(g->par.pools,
+			g->par.cnt*sizeof(VkCommandPool));
+		g->par.cbs = realloc(g->par.cbs,
+			g->par.cnt*sizeof(VkCommandBuffer));
+		for(; g->par.made < g->par.cnt; g->par.made++) {
+			size_t i = g->par.made;
+			vVvk_CreateCommandPool(g->par.dev, &(VkCommandPoolCreateInfo){
+				.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+				.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT,
+				.queueFamilyIndex = g->par.family,
+			}, NULL, &g->par.pools[i]);
+			vVvk_AllocateCommandBuffers(g->par.dev,
+				&(VkCommandBufferAllocateInfo){
+					.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+					.commandPool = g->par.pools[i],
+					.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY,
+					.commandBufferCount = 1,
+				}, &g->par.cbs[i]);
 		}
+	}
+
+	size_t* cnts = malloc((2*g->par.cnt + 1)*sizeof(size_t));
+	_vVpoolfor(g->par.workers, g->par.cnt, width, recChunk, &(chunks){
+		.V = V, .g = g, .rpass = info->renderPass,
+		.set = set, .set_ud = set_ud, .uset = uset, .uset_ud = uset_ud,
+		.cmd = cmd, .cmd_ud = cmd_ud,
+		.sets = cnts, .usets = &cnts[g->par.cnt],
+	});
+	g->counts.sets = g->counts.unsets = 0;
+	for(size_t c=0; c < g->par.cnt; c++) {
+		g->counts.sets += cnts[c];
+		g->counts.unsets += cnts[g->par.cnt + c];
+	}
+	free(cnts);
 
-		// Now execute the Step
-		if(cmd) cmd(cmd_ud, sp->udata, cbuff);
+	// Stitch them together, one vkCmdExecuteCommands per subpass
+	vVvk_CmdBeginRenderPass(cbuff, info,
+		VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	uint32_t sub = 0;
+	size_t from = 0;
+	for(size_t c=0; c <= g->par.cnt; c++) {
+		uint32_t s = c < g->par.cnt
+			? g->plan.steps[g->par.starts[c]].step->subpass : sub;
+		if(c < g->par.cnt && s == sub) continue;
+		if(c > from)
+			vVvk_CmdExecuteCommands(cbuff, c - from, &g->par.cbs[from]);
+		from = c;
+		for(; sub < s; sub++)
+			vVvk_CmdNextSubpass(cbuff,
+				VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
 	}
+	vVvk_CmdEndRenderPass(cbuff);
+}
+
+static void rec(const Vv* V, VvVkP_Graph* g,
+	VkCommandBuffer cbuff, VkRenderPassBeginInfo* info,
+	VkImage* imgs,
+	void (*set)(void*, void*, VkCommandBuffer), void* set_ud,
+	void (*uset)(void*, void*, VkCommandBuffer), void* uset_ud,
+	void (*cmd)(void*, void*, VkCommandBuffer), void* cmd_ud) {
+
+	sortSteps(g);
+	if(!g->plan.valid) makePlan(g);
+	g->counts.recorded = 0;
+
+	// Another frame, so older RenderPasses may be done with by now
+	g->passes.frame++;
+	for(size_t i=0; i < g->passes.cnt; i++)
+		if(g->passes.data[i].rpass == info->renderPass)
+			g->passes.data[i].used = g->passes.frame;
+	if(g->passes.cnt > 1) retirePasses(g);
+	if(g->cache.pool) {
+		recCached(V, g, cbuff, info, imgs, set, set_ud, cmd, cmd_ud);
+		return;
+	}
+	if(g->par.workers) {
+		recParallel(V, g, cbuff, info, imgs, set, set_ud, uset, uset_ud,
+			cmd, cmd_ud);
+		return;
+	}
+	g->counts.recorded = g->steps.cnt;
+
+	// The barriers only lack the Images, which can change every time
+	if(imgs)
+		for(size_t i=0; i < g->plan.imgcnt; i++)
+			g->plan.imgs[i].image = imgs[g->plan.atts[i]];
+
+	// Enter the RenderPass
+	VkSubpassContents contents = g->second
+		? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+		: VK_SUBPASS_CONTENTS_INLINE;
+	vVvk_CmdBeginRenderPass(cbuff, info, contents);
 
-	// Now unset all the extra States
-	if(uset) {
-		for(int i=0; i<statcnt; i++) {
-			if(setting[i])
-				uset(uset_ud, stats[i]->udata, cbuff);
+	const planTrans* ts = g->plan.trans;
+	for(size_t i=0; i < g->steps.cnt; i++) {
+		const planStep* op = &g->plan.steps[i];
+		const planTrans* t = &ts[op->trans];
+		for(uint32_t j=0; j < op->pre; j++, t++)
+			if(uset) uset(uset_ud, t->udata, cbuff);
+		for(uint32_t j=0; j < op->next; j++)
+			vVvk_CmdNextSubpass(cbuff, contents);
+		if(op->memcnt || op->imgcnt)
+			vVvk_CmdPipelineBarrier(cbuff, op->src, op->dst, op->flags,
+				op->memcnt, &op->mem, 0, NULL,
+				op->imgcnt, &g->plan.imgs[op->img]);
+		for(uint32_t j=0; j < op->post; j++, t++) {
+			if(t->set) { if(set) set(set_ud, t->udata, cbuff); }
+			else if(uset) uset(uset_ud, t->udata, cbuff);
 		}
+		if(cmd) cmd(cmd_ud, op->udata, cbuff);
 	}
+	if(uset)
+		for(size_t j = g->plan.last; j < g->plan.transcnt; j++)
+			uset(uset_ud, ts[j].udata, cbuff);
 
 	// Exit the RenderPass
 	vVvk_CmdEndRenderPass(cbuff);
@@ -429,8 +1682,11 @@ const VvVkP libVv_vkp_test = {
 	.addState = addSt,
 	.addStep = addSp, .removeStep = rmSp, .addDepends = depends,
 	.getRenderPass = getRP,
-	.getStates = getSts, .getSteps = getSps,
+	.getStates = getSts, .getSteps = getSps, .getCounts = getCnts,
 	.record = rec,
+	.setCache = setCache, .markDirty = markDirty,
+	.setParallel = setParallel,
+	.keepRenderPasses = keepPasses,
 };
 
 #endif // Vv_ENABLE_VULKAN
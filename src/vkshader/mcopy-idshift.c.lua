@@ -67,12 +67,12 @@ end
 function handlers.Id(c)
 	if c.mightbe then
 		out('\t\tif(READ >= idsz || !ids[last+shift].defined) BACK;')
-		out('\t\telse WRITE(ids[last+shift].map);')
-	else	out('\t\tWRITE(ids[READ+shift].map);') end
+		out('\t\telse ID(last);')
+	else	out('\t\tID(READ);') end
 end
 
 function handlers.IdResult(c)
-	handlers.Id(c)
+	out('\t\tRESULT(READ);')
 	out('\t\tids[last+shift].defined = true;')
 end
 
@@ -186,8 +186,8 @@ rout[=[
 #include <string.h>
 #include <stdio.h>
 
-uint32_t _vVvks_scan(uint32_t* src, uint32_t* dst,
-	uint32_t idsz, iddata ids[], uint32_t shift) {
+uint32_t _vVvks_scan(const uint32_t* src, uint32_t* dst,
+	uint32_t idsz, iddata ids[], uint32_t shift, uint32_t limit) {
 
 	// Decorations are forward ref, so we save it for later
 	if((src[0] & SpvOpCodeMask) == SpvOpDecorate) {
@@ -222,32 +222,46 @@ rout[=[
 
 	// Look to see if this is a dup of some other instruction. If it is,
 	// we mark it to be skipped, change its mapping, and don't write it out.
-	for(uint32_t i=0; i<idsz && i<dst[ind]; i++) {
+	// Only the ops with the same hash (decorations included) need to be
+	// compared, and of those the lowest <id> wins, as with a plain search.
+	iddata* d = &ids[dst[ind]];
+	uint32_t h = 2166136261u;
+	for(size_t j = 0; j < wc; j++)
+		if(j != ind) h = (h ^ dst[j]) * 16777619u;
+	h = (h ^ d->builtin) * 16777619u;
+	h = (h ^ d->location) * 16777619u;
+	h = (h ^ d->component) * 16777619u;
+	h %= idsz;
+	uint32_t match = 0;
+	for(uint32_t i = ids[h].head; i; i = ids[i].chain) {
 		uint32_t* o = ids[i].op;
-		if(o) {
-			for(size_t j = 0; j < wc; j++) {
-				if(j == ind) continue;
-				if(o[j] != dst[j]) {
-					o = NULL;
-					break;
-				}
-			}
-			if(o) {
-				iddata a = ids[o[ind]], b = ids[dst[ind]];
-				if(a.builtin == b.builtin && a.location == b.location && a.component == b.component) {
-					ids[dst[ind]].map = i;
-					return 0;
-				}
+		if(i >= limit || i >= dst[ind] || (match && i > match)) continue;
+		for(size_t j = 0; j < wc; j++) {
+			if(j == ind) continue;
+			if(o[j] != dst[j]) {
+				o = NULL;
+				break;
 			}
 		}
+		if(o) {
+			iddata a = ids[o[ind]], b = ids[dst[ind]];
+			if(a.builtin == b.builtin && a.location == b.location && a.component == b.component)
+				match = i;
+		}
+	}
+	if(match) {
+		ids[dst[ind]].map = match;
+		return 0;
 	}
 
 	// Otherwise, we set it up for comparisons later.
 	ids[dst[ind]].op = dst;
+	ids[dst[ind]].chain = ids[h].head;
+	ids[h].head = dst[ind];
 	return wc;
 }
 
-uint32_t _vVvks_copy(uint32_t* src, uint32_t* dst,
+uint32_t _vVvks_copy(const uint32_t* src, uint32_t* dst,
 	uint32_t idsz, iddata ids[], uint32_t shift) {
 
 	uint32_t opwc = *src;
@@ -255,7 +269,7 @@ uint32_t _vVvks_copy(uint32_t* src, uint32_t* dst,
 	uint32_t wc = opwc >> SpvWordCountShift;
 	uint32_t rwc = 0;
 
-	uint32_t* ssrc = src;
+	const uint32_t* ssrc = src;
 	uint32_t* sdst = dst;
 
 	uint32_t last;
@@ -264,41 +278,139 @@ uint32_t _vVvks_copy(uint32_t* src, uint32_t* dst,
 #define WRITE(W) ( *dst = W, dst++ )
 #define BACK ( src--, rwc-- )
 #define EOI ( rwc >= wc )
+#define ID(I) WRITE(ids[(I)+shift].map)
+#define RESULT(I) ID(I)
+#define SKIP(I) if(ids[(I)+shift].map != (I)+shift) return 0
+#define WIDTH(I) ( ids[(I)+shift].numwords = 1+((ssrc[2]-1)/32) )
 
 	WRITE(READ);	// Copy over the opcode + wordcnt
 	switch(op) {]=]
 
-for _,ins in ipairs(spv.instructions) do
-	out('\tcase Spv%s: ', ins.opname)
-	for i,o in ipairs(ins.operands or {}) do
-		if o.kind == 'IdResult' then
-			out('\t\tidres = ssrc[%d];', i)
-			out('\t\tif(ids[idres+shift].map != idres+shift) return 0;')
-			break
+-- The switch is the same for _vVvks_copy, _vVvks_ids and _vVvks_check, only
+-- the macros change. So write it once, and paste it in three times.
+local body = {}
+do
+	local real = out
+	out = function(s, ...) table.insert(body, s:format(...)) end
+	for _,ins in ipairs(spv.instructions) do
+		out('\tcase Spv%s: ', ins.opname)
+		for i,o in ipairs(ins.operands or {}) do
+			if o.kind == 'IdResult' then
+				out('\t\tidres = ssrc[%d];', i)
+				out('\t\tSKIP(idres);')
+				break
+			end
 		end
+		for i,arg in ipairs(ins.operands or {}) do
+			if arg.quantifier == '*' then out('\twhile(!EOI) {')
+			elseif arg.quantifier == '?' then out('\tif(!EOI) {')
+			elseif arg.quantifier then
+				error('Unhandled quantifier '..arg.quantifier) end
+			handlers[arg.kind]{
+				mightbe = arg.quantifier == '?',
+				from = ins.opname..'_'..i
+			}
+			if arg.quantifier then out('\t}') end
+		end
+		if ins.opname == 'OpTypeInt' or ins.opname == 'OpTypeFloat' then
+			-- Write down how many words this type uses, second operand.
+			-- This goes after the operands, so _vVvks_check can tell first
+			-- whether the width is there at all.
+			out'\t\tWIDTH(idres);'
+		end
+		out('\t\tbreak;')
 	end
-	if ins.opname == 'OpTypeInt' or ins.opname == 'OpTypeFloat' then
-		-- Write down how many words this type uses, second operand
-		out'\t\tids[idres+shift].numwords = 1+((ssrc[2]-1)/32);'
-	end
-	for i,arg in ipairs(ins.operands or {}) do
-		if arg.quantifier == '*' then out('\twhile(!EOI) {')
-		elseif arg.quantifier == '?' then out('\tif(!EOI) {')
-		elseif arg.quantifier then
-			error('Unhandled quantifier '..arg.quantifier) end
-		handlers[arg.kind]{
-			mightbe = arg.quantifier == '?',
-			from = ins.opname..'_'..i
-		}
-		if arg.quantifier then out('\t}') end
-	end
-	out('\t\tbreak;')
+	out = real
 end
+body = table.concat(body, '\n')
 
-out[[
+rout(body)
+rout[=[
 	case SpvOpMax: break;
 	};
 
 	return wc;
+#undef READ
+#undef WRITE
+#undef BACK
+#undef EOI
+#undef ID
+#undef RESULT
+#undef SKIP
+#undef WIDTH
+}
+
+uint32_t _vVvks_ids(uint32_t* src, uint32_t idsz, iddata ids[],
+	void (*f)(void*, uint32_t*, bool), void* ud) {
+
+	uint32_t opwc = *src;
+	SpvOp op = opwc & SpvOpCodeMask;
+	uint32_t wc = opwc >> SpvWordCountShift;
+	uint32_t rwc = 0;
+
+	const uint32_t* ssrc = src;
+	const uint32_t shift = 0;
+
+	uint32_t last;
+	uint32_t idres;
+#define READ ( last = *src, src++, rwc++, last )
+#define WRITE(W) ( (void)(W) )
+#define BACK ( src--, rwc-- )
+#define EOI ( rwc >= wc )
+#define ID(I) ( (void)(I), f(ud, src-1, false) )
+#define RESULT(I) ( (void)(I), f(ud, src-1, true) )
+#define SKIP(I)
+#define WIDTH(I) ( ids[(I)+shift].numwords = 1+((ssrc[2]-1)/32) )
+
+	READ;	// Skip over the opcode + wordcnt
+	switch(op) {]=]
+rout(body)
+rout[=[
+	case SpvOpMax: break;
+	};
+
+	return wc;
+#undef READ
+#undef WRITE
+#undef BACK
+#undef EOI
+#undef ID
+#undef RESULT
+#undef SKIP
+#undef WIDTH
+}
+
+uint32_t _vVvks_check(const uint32_t* src, uint32_t idsz, iddata ids[]) {
+	uint32_t opwc = *src;
+	SpvOp op = opwc & SpvOpCodeMask;
+	uint32_t wc = opwc >> SpvWordCountShift;
+	uint32_t rwc = 0;
+
+	const uint32_t* ssrc = src;
+	const uint32_t shift = 0;
+
+	uint32_t last;
+	uint32_t idres = 0;
+	// Reading past the end gives 0s, so strings and lists still stop.
+#define READ ( last = rwc < wc ? *src : 0, src++, rwc++, last )
+#define WRITE(W) ( (void)(W) )
+#define BACK ( src--, rwc-- )
+#define EOI ( rwc >= wc )
+#define ID(I) if((I) >= idsz) return 0
+#define RESULT(I) if((I) >= idsz || ids[last].defined) return 0
+#define SKIP(I) ID(I)
+// A width of 0 would make the later constants huge.
+#define WIDTH(I) if(rwc > wc || ssrc[2] == 0) return 0; \
+	else ids[I].numwords = 1+((ssrc[2]-1)/32)
+
+	READ;	// Skip over the opcode + wordcnt
+	switch(op) {]=]
+rout(body)
+out[[
+	case SpvOpMax: break;
+	};
+
+	// Operands that ran past the end mean the word count is too small.
+	return rwc > wc ? 0 : wc;
 }
 ]]
@@ -24,15 +24,31 @@ typedef struct {
 	size_t numwords;
 	uint32_t* op;
 	uint32_t builtin, location, component;
+	// _vVvks_scan's hash table. ids[h].head is the first <id> whose op
+	// hashes to h, and .chain the next one after it. 0 is the end.
+	uint32_t head, chain;
 } iddata;
-#define DEF_iddata(i) (iddata){false, i, 0, NULL, -1, -1, 0};
+#define DEF_iddata(i) (iddata){false, i, 0, NULL, -1, -1, 0, 0, 0};
 
 // Scans a single instruction. Pre-pass, and *dst is a temp space that may
-// be used for iddata.op.
-uint32_t _vVvks_scan(uint32_t* src, uint32_t* dst,
-	uint32_t idsz, iddata ids[], uint32_t shift);
+// be used for iddata.op. Only <id>s below <limit> are checked for being an
+// original that this instruction duplicates.
+uint32_t _vVvks_scan(const uint32_t* src, uint32_t* dst,
+	uint32_t idsz, iddata ids[], uint32_t shift, uint32_t limit);
 
 // Copys a single instruction from *src to *dst, shifting the IDs
 // by shift along the way.
-uint32_t _vVvks_copy(uint32_t* src, uint32_t* dst,
+uint32_t _vVvks_copy(const uint32_t* src, uint32_t* dst,
 	uint32_t idsz, iddata ids[], uint32_t shift);
+
+// Calls <f>(<ud>, <id>, <isresult>) for each <id> operand of the instruction
+// at *src, which may be changed in place. Like _vVvks_copy, <ids> is used to
+// tell optional <id>s apart from literals, and is updated along the way.
+uint32_t _vVvks_ids(uint32_t* src, uint32_t idsz, iddata ids[],
+	void (*f)(void*, uint32_t*, bool), void* ud);
+
+// Checks that the instruction at *src has all its operands within its word
+// count, all its <id>s below <idsz>, and no result <id> that an earlier
+// instruction already defined. Returns its word count if it does, 0 if it
+// doesn't. <ids> is used as for _vVvks_ids, and should start out zeroed.
+uint32_t _vVvks_check(const uint32_t* src, uint32_t idsz, iddata ids[]);
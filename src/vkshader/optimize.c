@@ -0,0 +1,226 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include "vkshader/optimize.h"
+#include "vkshader/mcopy.h"
+#include <stdlib.h>
+#include <string.h>
+
+// What happens to each instruction. Everything in a Function lives or dies
+// with the Function, except for the debug info which can be stripped.
+enum {
+	KEEP,	// Always kept, and keeps what it uses alive
+	IFUSED,	// Kept if something uses its result
+	IFTARGET,	// Kept if the <id> in the first operand is kept
+	STRIP,	// Never kept
+};
+
+typedef struct {
+	uint32_t* code;
+	uint32_t bound;
+	iddata* ids;	// For _vVvks_ids to keep track of things
+	size_t cnt;	// The number of instructions, indices below are into these
+	size_t* at;	// Where each instruction starts
+	char* kind;	// What to do with each instruction, as above
+	char* live;	// Whether each instruction is being kept
+	size_t* func;	// The OpFunction each one is in, or <cnt> if none
+	size_t* fend;	// For OpFunctions, just past the OpFunctionEnd
+	size_t* def;	// The instruction that defines each <id>, plus 1
+	size_t* targeted;	// The first IFTARGET for each <id>, plus 1
+	size_t* next;	// The next IFTARGET with the same target, plus 1
+	char* idlive;	// Whether each <id> is used by a kept instruction
+	uint32_t* stack;	// <id>s which are live but not handled yet
+	size_t top;
+	size_t cur;	// The instruction being looked at, for the callbacks
+	int hasres;	// Whether <cur> has a result <id>
+	uint32_t* map;	// New <id> for each old one, or 0 if not given yet
+	uint32_t newbound;
+} trim;
+
+static int isDebug(uint32_t op) {
+	switch(op) {
+	case SpvOpSourceContinued:
+	case SpvOpSource:
+	case SpvOpSourceExtension:
+	case SpvOpName:
+	case SpvOpMemberName:
+	case SpvOpString:
+	case SpvOpLine:
+	case SpvOpNoLine:
+	case SpvOpModuleProcessed:
+		return 1;
+	default: return 0;
+	}
+}
+
+static int kindOf(const uint32_t* ins, int infunc, int hasres, int level) {
+	uint32_t op = ins[0] & SpvOpCodeMask;
+	if(level >= OPT_STRIP && isDebug(op)) return STRIP;
+	if(infunc) return KEEP;
+	switch(op) {
+	case SpvOpDecorate:
+		// A BuiltIn constant (WorkgroupSize) has an effect without any uses.
+		if((ins[0] >> SpvWordCountShift) >= 3
+			&& ins[2] == SpvDecorationBuiltIn) return KEEP;
+		return IFTARGET;
+	case SpvOpName:
+	case SpvOpMemberName:
+	case SpvOpMemberDecorate:
+	case SpvOpDecorateId:
+	case SpvOpTypeForwardPointer:
+		return IFTARGET;
+	// Imports are cheap, and groups are too rare to bother with.
+	case SpvOpExtInstImport:
+	case SpvOpString:
+	case SpvOpDecorationGroup:
+		return KEEP;
+	default: return hasres ? IFUSED : KEEP;
+	}
+}
+
+static void noteDef(void* vt, uint32_t* id, bool res) {
+	trim* t = vt;
+	if(res && *id < t->bound) {
+		t->def[*id] = t->cur+1;
+		t->hasres = 1;
+	}
+}
+
+static void markId(void* vt, uint32_t* id, bool res) {
+	trim* t = vt;
+	if(*id >= t->bound || t->idlive[*id]) return;
+	t->idlive[*id] = 1;
+	t->stack[t->top++] = *id;
+}
+
+static void markOne(trim* t, size_t i) {
+	if(t->live[i] || t->kind[i] == STRIP) return;
+	t->live[i] = 1;
+	_vVvks_ids(&t->code[t->at[i]], t->bound, t->ids, markId, t);
+}
+
+static void mark(trim* t, size_t i) {
+	if(t->live[i] || t->kind[i] == STRIP) return;
+	if(t->func[i] == t->cnt) markOne(t, i);
+	else for(size_t j = t->func[i]; j < t->fend[t->func[i]]; j++)
+		markOne(t, j);
+}
+
+static void renumber(void* vt, uint32_t* id, bool res) {
+	trim* t = vt;
+	if(*id >= t->bound) return;
+	if(!t->map[*id]) t->map[*id] = t->newbound++;
+	*id = t->map[*id];
+}
+
+static void cleanup(trim* t) {
+	free(t->ids);
+	free(t->at);
+	free(t->kind);
+	free(t->live);
+	free(t->func);
+	free(t->fend);
+	free(t->next);
+	free(t->def);
+	free(t->targeted);
+	free(t->idlive);
+	free(t->stack);
+	free(t->map);
+}
+
+size_t _vVvks_optimize(uint32_t* code, size_t size, int level) {
+	if(level <= OPT_NONE || size < 5) return size;
+
+	trim t = {.code = code, .bound = code[3], .cnt = 0};
+	for(size_t here = 5; here < size; t.cnt++) {
+		uint32_t wc = code[here] >> SpvWordCountShift;
+		if(wc == 0 || here+wc > size) return size;
+		here += wc;
+	}
+
+	t.ids = malloc(t.bound*sizeof(iddata));
+	for(uint32_t i=0; i < t.bound; i++) t.ids[i] = DEF_iddata(i);
+	t.at = malloc(t.cnt*sizeof(size_t));
+	t.kind = malloc(t.cnt);
+	t.live = calloc(t.cnt, 1);
+	t.func = malloc(t.cnt*sizeof(size_t));
+	t.fend = malloc(t.cnt*sizeof(size_t));
+	t.next = calloc(t.cnt, sizeof(size_t));
+	t.def = calloc(t.bound, sizeof(size_t));
+	t.targeted = calloc(t.bound, sizeof(size_t));
+	t.idlive = calloc(t.bound, 1);
+	t.stack = malloc(t.bound*sizeof(uint32_t));
+	t.map = calloc(t.bound, sizeof(uint32_t));
+	t.top = 0;
+
+	// First walk, to find out what everything is and where it lives.
+	size_t here = 5, fstart = t.cnt;
+	for(t.cur = 0; t.cur < t.cnt; t.cur++) {
+		size_t i = t.cur;
+		uint32_t op = code[here] & SpvOpCodeMask;
+		t.at[i] = here;
+		if(op == SpvOpFunction) fstart = i;
+		t.func[i] = fstart;
+		if(op == SpvOpFunctionEnd && fstart < t.cnt) {
+			t.fend[fstart] = i+1;
+			fstart = t.cnt;
+		}
+
+		t.hasres = 0;
+		here += _vVvks_ids(&code[here], t.bound, t.ids, noteDef, &t);
+		t.kind[i] = kindOf(&code[t.at[i]], t.func[i] < t.cnt, t.hasres,
+			level);
+		if(t.kind[i] == IFTARGET) {
+			uint32_t target = code[t.at[i]+1];
+			if(target < t.bound) {
+				t.next[i] = t.targeted[target];
+				t.targeted[target] = i+1;
+			}
+		}
+	}
+	if(fstart < t.cnt) {	// Unfinished Function, best not to touch it
+		cleanup(&t);
+		return size;
+	}
+
+	// Then mark everything that's needed, starting from what's always kept.
+	// Every live <id> keeps its definition and its decorations alive.
+	for(size_t i=0; i < t.cnt; i++)
+		if(t.kind[i] == KEEP && t.func[i] == t.cnt) mark(&t, i);
+	while(t.top > 0) {
+		uint32_t id = t.stack[--t.top];
+		if(t.def[id]) mark(&t, t.def[id]-1);
+		for(size_t i = t.targeted[id]; i; i = t.next[i-1])
+			mark(&t, i-1);
+	}
+
+	// Finally, pack the live instructions down, giving out new <id>s in the
+	// order they first show up.
+	for(uint32_t i=0; i < t.bound; i++) t.ids[i] = DEF_iddata(i);
+	t.newbound = 1;
+	size_t out = 5;
+	for(size_t i=0; i < t.cnt; i++) {
+		if(!t.live[i]) continue;
+		uint32_t wc = _vVvks_ids(&code[t.at[i]], t.bound, t.ids,
+			renumber, &t);
+		memmove(&code[out], &code[t.at[i]], wc*sizeof(uint32_t));
+		out += wc;
+	}
+	code[3] = t.newbound;
+
+	cleanup(&t);
+	return out;
+}
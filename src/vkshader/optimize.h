@@ -0,0 +1,34 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifndef H_vkshader_optimize
+#define H_vkshader_optimize
+
+#include <stdint.h>
+#include <stddef.h>
+
+// How hard _vVvks_optimize should try. Each level includes the ones below it.
+enum {
+	OPT_NONE,	// Leave the module as it is
+	OPT_TRIM,	// Remove anything the EPs can't reach, and renumber the <id>s
+	OPT_STRIP,	// Also remove debug info (names, strings, lines)
+};
+
+// Shrink the SPIR-V module in <code> in place, and return its new size in
+// words. If the module can't be walked it is left alone.
+size_t _vVvks_optimize(uint32_t* code, size_t size, int level);
+
+#endif // H_vkshader_optimize
@@ -0,0 +1,117 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include "vkshader/pack.h"
+#include "vkshader/mcopy.h"
+#include <stdlib.h>
+#include <string.h>
+
+static size_t putVar(uint8_t* out, uint32_t v) {
+	size_t n = 0;
+	while(v >= 0x80) {
+		out[n++] = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	out[n++] = v;
+	return n;
+}
+
+static uint32_t getVar(const uint8_t** in) {
+	uint32_t v = 0;
+	for(int shift = 0;; shift += 7) {
+		uint8_t b = *(*in)++;
+		v |= (uint32_t)(b & 0x7F) << shift;
+		if(!(b & 0x80) || shift >= 28) return v;
+	}
+}
+
+static uint32_t zigzag(int32_t v) { return ((uint32_t)v << 1) ^ (v >> 31); }
+static int32_t unzigzag(uint32_t v) { return (int32_t)(v >> 1) ^ -(int32_t)(v & 1); }
+
+typedef struct {
+	const uint32_t* ins;
+	uint8_t* mask;	// Bit i set if operand word i+1 is an <id>
+} idmask;
+
+static void noteId(void* vm, uint32_t* id, bool isres) {
+	idmask* m = vm;
+	size_t i = id - m->ins - 1;
+	m->mask[i/8] |= 1 << (i%8);
+}
+
+uint8_t* _vVvks_pack(const uint32_t* code, size_t size, size_t* bytes) {
+	// Worst case is 5 bytes a word, plus the masks.
+	uint8_t* out = malloc(size*5 + size/4 + 8);
+	size_t here = 0;
+	for(size_t i=0; i<5; i++) here += putVar(&out[here], code[i]);
+
+	uint32_t bound = code[3];
+	iddata* ids = malloc(bound*sizeof(iddata));
+	for(uint32_t i=0; i < bound; i++) ids[i] = DEF_iddata(i);
+
+	// _vVvks_ids wants to be able to write, so each instruction is copied.
+	uint32_t* ins = malloc(0xFFFF*sizeof(uint32_t));
+	uint8_t mask[0xFFFF/8+1];
+	uint32_t last = 0;
+	for(size_t at = 5; at < size;) {
+		uint32_t wc = code[at] >> SpvWordCountShift;
+		memcpy(ins, &code[at], wc*sizeof(uint32_t));
+		size_t mbytes = (wc-1+7)/8;
+		memset(mask, 0, mbytes);
+		_vVvks_ids(ins, bound, ids, noteId, &(idmask){ins, mask});
+
+		here += putVar(&out[here], code[at] & SpvOpCodeMask);
+		here += putVar(&out[here], wc);
+		memcpy(&out[here], mask, mbytes);
+		here += mbytes;
+		for(uint32_t i=1; i < wc; i++) {
+			uint32_t w = code[at+i];
+			if(mask[(i-1)/8] & 1 << ((i-1)%8)) {
+				here += putVar(&out[here], zigzag((int32_t)(w - last)));
+				last = w;
+			} else here += putVar(&out[here], w);
+		}
+		at += wc;
+	}
+	free(ins);
+	free(ids);
+
+	*bytes = here;
+	return realloc(out, here);
+}
+
+void _vVvks_unpack(const uint8_t* packed, size_t bytes, uint32_t* code) {
+	const uint8_t* in = packed;
+	const uint8_t* end = packed + bytes;
+	for(size_t i=0; i<5; i++) code[i] = getVar(&in);
+
+	size_t at = 5;
+	uint32_t last = 0;
+	while(in < end) {
+		uint32_t op = getVar(&in);
+		uint32_t wc = getVar(&in);
+		const uint8_t* mask = in;
+		in += (wc-1+7)/8;
+		code[at] = wc << SpvWordCountShift | op;
+		for(uint32_t i=1; i < wc; i++) {
+			if(mask[(i-1)/8] & 1 << ((i-1)%8)) {
+				code[at+i] = last + unzigzag(getVar(&in));
+				last = code[at+i];
+			} else code[at+i] = getVar(&in);
+		}
+		at += wc;
+	}
+}
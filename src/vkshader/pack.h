@@ -0,0 +1,35 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifndef H_vkshader_pack
+#define H_vkshader_pack
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A compact byte encoding for SPIR-V, along the lines of SMOL-V. Each
+// instruction is its opcode and word count, a bitmask of which operands are
+// <id>s, and then the operands as varints. <id>s are stored as the
+// (zigzagged) difference from the <id> before them, which is usually small.
+
+// Pack the <size> words of <code>, returning a malloc'd buffer of *<bytes>.
+// The word counts in <code> must already have been checked.
+uint8_t* _vVvks_pack(const uint32_t* code, size_t size, size_t* bytes);
+
+// Unpack <packed> into <code>, which must have room for the original words.
+void _vVvks_unpack(const uint8_t* packed, size_t bytes, uint32_t* code);
+
+#endif // H_vkshader_pack
@@ -0,0 +1,329 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifdef Vv_ENABLE_VULKAN
+
+#define Vv_CHOICE *V
+#define Vv_IMP_vks
+#include "vkshader/reflect.h"
+#include "spirv/1.2/spirv.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// The decorations we care about for each <id>.
+typedef struct {
+	size_t at;	// Where the instruction defining it is, or 0
+	uint32_t set, binding, location, arraystride;
+	bool hasset, hasbinding, haslocation, bufferblock, builtin;
+	bool vertexin;	// In the Vertex EP's interface
+	uint32_t builtinval;
+} refid;
+
+typedef struct {
+	const uint32_t* code;
+	uint32_t bound;
+	refid* ids;
+	size_t annotate, annotateend;	// Where to look for OpMemberDecorates
+} refl;
+
+#define INS(ID) (&r->code[r->ids[ID].at])
+#define OPOF(ID) (r->ids[ID].at ? INS(ID)[0] & SpvOpCodeMask : SpvOpNop)
+
+// The value of an integer (default) constant, or <def> if its not one.
+static uint32_t constVal(const refl* r, uint32_t id, uint32_t def) {
+	if(id >= r->bound) return def;
+	if(OPOF(id) != SpvOpConstant && OPOF(id) != SpvOpSpecConstant) return def;
+	return INS(id)[3];
+}
+
+// Find a particular member decoration's value, or return <def>.
+static uint32_t memberDeco(const refl* r, uint32_t st, uint32_t mem,
+	uint32_t deco, uint32_t def) {
+
+	for(size_t here = r->annotate; here < r->annotateend;
+		here += r->code[here] >> SpvWordCountShift) {
+
+		const uint32_t* ins = &r->code[here];
+		if((ins[0] & SpvOpCodeMask) == SpvOpMemberDecorate
+			&& (ins[0] >> SpvWordCountShift) >= 5
+			&& ins[1] == st && ins[2] == mem && ins[3] == deco)
+			return ins[4];
+	}
+	return def;
+}
+
+// The size of a type in bytes, as laid out with its explicit strides and
+// offsets. <matstride> is the MatrixStride from the enclosing member.
+static uint32_t typeSize(const refl* r, uint32_t id, uint32_t matstride,
+	int depth) {
+
+	if(id >= r->bound || !r->ids[id].at || depth > 32) return 0;
+	const uint32_t* ins = INS(id);
+	uint32_t wc = ins[0] >> SpvWordCountShift;
+	switch(ins[0] & SpvOpCodeMask) {
+	case SpvOpTypeBool: return 4;
+	case SpvOpTypeInt:
+	case SpvOpTypeFloat:
+		return ins[2] / 8;
+	case SpvOpTypeVector:
+		return ins[3] * typeSize(r, ins[2], 0, depth+1);
+	case SpvOpTypeMatrix:
+		if(matstride) return ins[3] * matstride;
+		return ins[3] * typeSize(r, ins[2], 0, depth+1);
+	case SpvOpTypeArray: {
+		uint32_t len = constVal(r, ins[3], 0);
+		if(r->ids[id].arraystride) return len * r->ids[id].arraystride;
+		return len * typeSize(r, ins[2], matstride, depth+1);
+	}
+	case SpvOpTypeStruct: {
+		uint32_t sz = 0;
+		for(uint32_t m = 0; m+2 < wc; m++) {
+			uint32_t off = memberDeco(r, id, m, SpvDecorationOffset, sz);
+			uint32_t ms = memberDeco(r, id, m, SpvDecorationMatrixStride, 0);
+			uint32_t end = off + typeSize(r, ins[m+2], ms, depth+1);
+			if(end > sz) sz = end;
+		}
+		return sz;
+	}
+	default: return 0;
+	}
+}
+
+// Work out what kind of descriptor a variable of type <ty> in <sc> is, and
+// how many of them there are.
+static bool descriptor(const refl* r, uint32_t ty, uint32_t sc,
+	VkDescriptorType* type, uint32_t* count) {
+
+	*count = 1;
+	for(int depth = 0; ty < r->bound && depth < 32; depth++) {
+		const uint32_t* ins = INS(ty);
+		switch(OPOF(ty)) {
+		case SpvOpTypeArray:
+			*count *= constVal(r, ins[3], 1);
+			ty = ins[2];
+			continue;
+		case SpvOpTypeRuntimeArray:
+			*count = 0;	// Its up to the layout to say how many
+			ty = ins[2];
+			continue;
+		case SpvOpTypeStruct:
+			if(sc == SpvStorageClassStorageBuffer || r->ids[ty].bufferblock)
+				*type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+			else if(sc == SpvStorageClassUniform)
+				*type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+			else return false;
+			return true;
+		case SpvOpTypeSampler:
+			*type = VK_DESCRIPTOR_TYPE_SAMPLER;
+			return true;
+		case SpvOpTypeSampledImage:
+			if(OPOF(ins[2]) == SpvOpTypeImage
+				&& INS(ins[2])[3] == SpvDimBuffer)
+				*type = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+			else *type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+			return true;
+		case SpvOpTypeImage:
+			if((ins[0] >> SpvWordCountShift) < 9) return false;
+			if(ins[3] == SpvDimSubpassData)
+				*type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+			else if(ins[3] == SpvDimBuffer)
+				*type = ins[7] == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER
+					: VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+			else *type = ins[7] == 2 ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE
+				: VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+			return true;
+		default: return false;
+		}
+	}
+	return false;
+}
+
+VvVkS_Reflection* _vVvks_reflect(const uint32_t* code, size_t size) {
+	refl rr = {.code = code, .bound = code[3]};
+	refl* r = &rr;
+	r->ids = calloc(r->bound, sizeof(refid));
+
+	VkShaderStageFlags stages = 0;
+	size_t vertex = 0;	// The Vertex EP, for its inputs
+	uint32_t compute = 0;	// And the GLCompute EP's Function
+	VkExtent3D wgsize = {0, 0, 0};
+	uint32_t wgids[3] = {0, 0, 0};
+	size_t nbind = 0, ninput = 0;
+
+	// One walk over the globals to find out where everything is.
+	size_t here;
+	for(here = 5; here < size; here += code[here] >> SpvWordCountShift) {
+		const uint32_t* ins = &code[here];
+		uint32_t op = ins[0] & SpvOpCodeMask;
+		uint32_t wc = ins[0] >> SpvWordCountShift;
+		if(wc == 0 || here + wc > size || op == SpvOpFunction) break;
+		if(!r->annotate && (op == SpvOpDecorate
+			|| op == SpvOpMemberDecorate)) r->annotate = here;
+		if(op == SpvOpMemberDecorate) r->annotateend = here + wc;
+
+		switch(op) {
+		case SpvOpEntryPoint:
+			if(wc < 4 || ins[1] > SpvExecutionModelGLCompute) break;
+			stages |= 1 << ins[1];	// Models and stage bits line up
+			if(ins[1] == SpvExecutionModelVertex && !vertex) vertex = here;
+			if(ins[1] == SpvExecutionModelGLCompute && !compute) {
+				compute = ins[2];
+				wgsize = (VkExtent3D){1, 1, 1};
+			}
+			break;
+		case SpvOpExecutionMode:
+		case SpvOpExecutionModeId:
+			if(wc < 6 || ins[1] != compute) break;
+			if(ins[2] == SpvExecutionModeLocalSize)
+				wgsize = (VkExtent3D){ins[3], ins[4], ins[5]};
+			else if(ins[2] == SpvExecutionModeLocalSizeId)
+				memcpy(wgids, &ins[3], sizeof(wgids));
+			break;
+		case SpvOpDecorate: {
+			if(wc < 3 || ins[1] >= r->bound) break;
+			refid* d = &r->ids[ins[1]];
+			uint32_t v = wc > 3 ? ins[3] : 0;
+			switch(ins[2]) {
+			case SpvDecorationDescriptorSet:
+				d->set = v;
+				d->hasset = true;
+				break;
+			case SpvDecorationBinding:
+				d->binding = v;
+				d->hasbinding = true;
+				break;
+			case SpvDecorationLocation:
+				d->location = v;
+				d->haslocation = true;
+				break;
+			case SpvDecorationArrayStride: d->arraystride = v; break;
+			case SpvDecorationBufferBlock: d->bufferblock = true; break;
+			case SpvDecorationBuiltIn:
+				d->builtin = true;
+				d->builtinval = v;
+				break;
+			}
+			break;
+		}
+		case SpvOpVariable:
+			if(wc < 4 || ins[2] >= r->bound) break;
+			r->ids[ins[2]].at = here;
+			if(ins[3] == SpvStorageClassUniformConstant
+				|| ins[3] == SpvStorageClassUniform
+				|| ins[3] == SpvStorageClassStorageBuffer) nbind++;
+			if(ins[3] == SpvStorageClassInput) ninput++;
+			break;
+		default:
+			// Types have their result in the first operand, constants in
+			// the second. Nothing else here matters.
+			if(op >= SpvOpTypeVoid && op <= SpvOpTypeForwardPointer) {
+				if(wc >= 2 && ins[1] < r->bound) r->ids[ins[1]].at = here;
+			} else if(op >= SpvOpConstantTrue && op <= SpvOpSpecConstantOp) {
+				if(wc >= 3 && ins[2] < r->bound) r->ids[ins[2]].at = here;
+			}
+			break;
+		}
+	}
+
+	VvVkS_Reflection* ref = malloc(sizeof(VvVkS_Reflection)
+		+ nbind*sizeof(VvVkS_Binding) + ninput*sizeof(uint32_t));
+	ref->stages = stages;
+	ref->bindings = (VvVkS_Binding*)&ref[1];
+	ref->bindingCount = 0;
+	ref->inputs = (uint32_t*)&ref->bindings[nbind];
+	ref->inputCount = 0;
+	ref->pushConstantSize = 0;
+
+	// The Vertex EP's interface, to tell its Inputs from the others'.
+	const uint32_t* vins = vertex ? &code[vertex] : NULL;
+	uint32_t vwc = vins ? vins[0] >> SpvWordCountShift : 0;
+	uint32_t vfirst = vwc;
+	if(vins) for(vfirst = 3; vfirst < vwc; vfirst++) {
+		uint32_t w = vins[vfirst];
+		if(!(w>>24 && (w>>16)&0xFF && (w>>8)&0xFF && w&0xFF)) {
+			vfirst++;
+			break;
+		}
+	}
+	for(uint32_t i = vfirst; i < vwc; i++)
+		if(vins[i] < r->bound) r->ids[vins[i]].vertexin = true;
+
+	// Then the variables, which are what we actually want to know about.
+	for(uint32_t id = 1; id < r->bound; id++) {
+		if(OPOF(id) != SpvOpVariable) continue;
+		const uint32_t* ins = INS(id);
+		uint32_t sc = ins[3];
+		uint32_t ty = ins[1];
+		if(OPOF(ty) != SpvOpTypePointer) continue;
+		ty = INS(ty)[3];
+		refid* d = &r->ids[id];
+
+		if(sc == SpvStorageClassPushConstant) {
+			uint32_t sz = typeSize(r, ty, 0, 0);
+			if(sz > ref->pushConstantSize) ref->pushConstantSize = sz;
+		} else if(sc == SpvStorageClassInput) {
+			if(!d->haslocation || d->builtin || !d->vertexin) continue;
+			ref->inputs[ref->inputCount++] = d->location;
+		} else if(sc == SpvStorageClassUniformConstant
+			|| sc == SpvStorageClassUniform
+			|| sc == SpvStorageClassStorageBuffer) {
+
+			VvVkS_Binding* b = &ref->bindings[ref->bindingCount];
+			if(!d->hasbinding || !descriptor(r, ty, sc, &b->type, &b->count))
+				continue;
+			b->set = d->hasset ? d->set : 0;
+			b->binding = d->binding;
+			b->stages = stages;	// We don't know which EPs use what
+
+			// Merged Components may well share bindings, list them once.
+			bool dup = false;
+			for(size_t i=0; i < ref->bindingCount && !dup; i++)
+				if(ref->bindings[i].set == b->set
+					&& ref->bindings[i].binding == b->binding) dup = true;
+			if(!dup) ref->bindingCount++;
+		}
+	}
+
+	// A WorkgroupSize BuiltIn overrides whatever the EMs say. It is often a
+	// spec constant, in which case its parts' defaults are what's used.
+	if(compute) {
+		if(wgids[0]) wgsize = (VkExtent3D){
+			constVal(r, wgids[0], 1), constVal(r, wgids[1], 1),
+			constVal(r, wgids[2], 1),
+		};
+		for(uint32_t id = 1; id < r->bound; id++) {
+			const refid* d = &r->ids[id];
+			if(!d->builtin || d->builtinval != SpvBuiltInWorkgroupSize)
+				continue;
+			if(OPOF(id) != SpvOpConstantComposite
+				&& OPOF(id) != SpvOpSpecConstantComposite) continue;
+			const uint32_t* ins = INS(id);
+			if((ins[0] >> SpvWordCountShift) < 6) continue;
+			wgsize = (VkExtent3D){
+				constVal(r, ins[3], wgsize.width),
+				constVal(r, ins[4], wgsize.height),
+				constVal(r, ins[5], wgsize.depth),
+			};
+		}
+	}
+	ref->workgroupSize = wgsize;
+
+	free(r->ids);
+	return ref;
+}
+
+#endif // Vv_ENABLE_VULKAN
@@ -0,0 +1,28 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifndef H_vkshader_reflect
+#define H_vkshader_reflect
+
+#include <vivacious/vkshader.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Work out the Reflection for the SPIR-V module in <code>. The result is
+// a single allocation, so it can be freed with free().
+VvVkS_Reflection* _vVvks_reflect(const uint32_t* code, size_t size);
+
+#endif // H_vkshader_reflect
@@ -0,0 +1,311 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include "vkshader/specialize.h"
+#include "spirv/1.2/spirv.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+// What we know about each <id>, enough to fold scalar integer math.
+typedef struct {
+	enum { T_NONE, T_BOOL, T_INT, T_FLOAT } type;	// For OpTypes
+	uint32_t width;
+	bool sign;
+
+	uint32_t rtype;	// For constants, their type and value if known
+	bool known;
+	uint64_t val;
+	bool constant;	// Set once it's a normal constant, not a spec one
+	size_t at;	// And where their (rewritten) instruction is
+	int32_t specid;	// From the SpecId decoration, or -1
+} idinfo;
+
+static uint64_t clip(uint64_t v, uint32_t width) {
+	return width >= 64 ? v : v & ((UINT64_C(1) << width) - 1);
+}
+
+static int64_t sext(uint64_t v, uint32_t width) {
+	if(width >= 64) return (int64_t)v;
+	uint64_t sign = UINT64_C(1) << (width-1);
+	return (int64_t)((clip(v, width) ^ sign) - sign);
+}
+
+// Get <v> ready to go in the literal of a constant of <type>. Narrow signed
+// types are sign-extended to fill the word.
+static uint64_t encode(uint64_t v, const idinfo* type) {
+	if(type->type == T_INT && type->sign && type->width < 32)
+		return (uint32_t)sext(v, type->width);
+	return v;
+}
+
+// Find the value for <specid> in <si>, if its there.
+static bool specValue(const VkSpecializationInfo* si, int32_t specid,
+	uint64_t* val) {
+
+	if(!si || specid < 0) return false;
+	for(uint32_t i=0; i < si->mapEntryCount; i++) {
+		const VkSpecializationMapEntry* e = &si->pMapEntries[i];
+		if(e->constantID != (uint32_t)specid) continue;
+		size_t sz = e->size < sizeof(uint64_t) ? e->size : sizeof(uint64_t);
+		if(e->offset + sz > si->dataSize) return false;
+		*val = 0;
+		memcpy(val, (const char*)si->pData + e->offset, sz);
+		return true;
+	}
+	return false;
+}
+
+// Work out the OpSpecConstantOp at <ins>, if it only uses known scalars.
+static bool fold(const uint32_t* ins, const idinfo* info, uint32_t bound,
+	uint64_t* res) {
+
+	uint32_t wc = ins[0] >> SpvWordCountShift;
+	const idinfo* rt = &info[ins[1]];
+	if(rt->type != T_BOOL && rt->type != T_INT) return false;
+
+	const idinfo* a[3] = {NULL, NULL, NULL};
+	for(uint32_t i=4; i < wc && i < 7; i++) {
+		if(ins[i] >= bound || !info[ins[i]].known) return false;
+		a[i-4] = &info[ins[i]];
+	}
+	if(wc < 5) return false;
+	uint32_t aw = info[a[0]->rtype].width;
+	if(aw == 0) aw = 1;	// Bools don't have a width
+	uint64_t x = a[0]->val, y = a[1] ? a[1]->val : 0;
+	int64_t sx = sext(x, aw), sy = sext(y, aw);
+#define BINARY if(!a[1]) return false;
+
+	switch(ins[3]) {
+	case SpvOpSConvert: *res = sext(x, aw); break;
+	case SpvOpUConvert: *res = clip(x, aw); break;
+	case SpvOpSNegate: *res = -x; break;
+	case SpvOpNot: *res = ~x; break;
+	case SpvOpIAdd: BINARY *res = x + y; break;
+	case SpvOpISub: BINARY *res = x - y; break;
+	case SpvOpIMul: BINARY *res = x * y; break;
+	case SpvOpUDiv: BINARY
+		if(clip(y, aw) == 0) return false;
+		*res = clip(x, aw) / clip(y, aw);
+		break;
+	case SpvOpSDiv: BINARY
+		if(sy == 0 || (sy == -1 && sx == INT64_MIN)) return false;
+		*res = sx / sy;
+		break;
+	case SpvOpUMod: BINARY
+		if(clip(y, aw) == 0) return false;
+		*res = clip(x, aw) % clip(y, aw);
+		break;
+	case SpvOpSRem: BINARY
+		if(sy == 0 || (sy == -1 && sx == INT64_MIN)) return false;
+		*res = sx % sy;
+		break;
+	case SpvOpSMod: BINARY
+		if(sy == 0 || (sy == -1 && sx == INT64_MIN)) return false;
+		// Takes the sign of the divisor, without overflowing on the way
+		sx %= sy;
+		if(sx && ((sx < 0) != (sy < 0))) sx += sy;
+		*res = sx;
+		break;
+	case SpvOpShiftRightLogical: BINARY
+		if(clip(y, 64) >= aw) return false;
+		*res = clip(x, aw) >> y;
+		break;
+	case SpvOpShiftRightArithmetic: BINARY
+		if(clip(y, 64) >= aw) return false;
+		*res = sx >> y;
+		break;
+	case SpvOpShiftLeftLogical: BINARY
+		if(clip(y, 64) >= aw) return false;
+		*res = x << y;
+		break;
+	case SpvOpBitwiseOr: BINARY *res = x | y; break;
+	case SpvOpBitwiseXor: BINARY *res = x ^ y; break;
+	case SpvOpBitwiseAnd: BINARY *res = x & y; break;
+	case SpvOpLogicalOr: BINARY *res = x || y; break;
+	case SpvOpLogicalAnd: BINARY *res = x && y; break;
+	case SpvOpLogicalNot: *res = !x; break;
+	case SpvOpLogicalEqual: BINARY *res = !x == !y; break;
+	case SpvOpLogicalNotEqual: BINARY *res = !x != !y; break;
+	case SpvOpSelect:
+		if(!a[2]) return false;
+		*res = x ? y : a[2]->val;
+		break;
+	case SpvOpIEqual: BINARY *res = clip(x, aw) == clip(y, aw); break;
+	case SpvOpINotEqual: BINARY *res = clip(x, aw) != clip(y, aw); break;
+	case SpvOpUGreaterThan: BINARY *res = clip(x, aw) > clip(y, aw); break;
+	case SpvOpSGreaterThan: BINARY *res = sx > sy; break;
+	case SpvOpUGreaterThanEqual: BINARY
+		*res = clip(x, aw) >= clip(y, aw);
+		break;
+	case SpvOpSGreaterThanEqual: BINARY *res = sx >= sy; break;
+	case SpvOpULessThan: BINARY *res = clip(x, aw) < clip(y, aw); break;
+	case SpvOpSLessThan: BINARY *res = sx < sy; break;
+	case SpvOpULessThanEqual: BINARY
+		*res = clip(x, aw) <= clip(y, aw);
+		break;
+	case SpvOpSLessThanEqual: BINARY *res = sx <= sy; break;
+	default: return false;
+	}
+#undef BINARY
+	if(rt->type == T_BOOL) *res = !!*res;
+	else *res = clip(*res, rt->width);
+	return true;
+}
+
+size_t _vVvks_specialize(uint32_t* code, size_t size,
+	const VkSpecializationInfo* si) {
+
+	uint32_t bound = code[3];
+	idinfo* info = malloc(bound*sizeof(idinfo));
+	for(uint32_t i=0; i < bound; i++)
+		info[i] = (idinfo){.type = T_NONE, .known = false, .specid = -1};
+
+	// Everything we care about is before the Functions, and every
+	// instruction only gets shorter, so this can all be done in one pass.
+	size_t here = 5, out = 5;
+	while(here < size) {
+		uint32_t* ins = &code[here];
+		uint32_t op = ins[0] & SpvOpCodeMask;
+		uint32_t wc = ins[0] >> SpvWordCountShift;
+		if(wc == 0 || here + wc > size) break;
+		if(op == SpvOpFunction) break;
+		here += wc;
+
+#define ID(N) (wc > (N) && ins[N] < bound)
+		switch(op) {
+		case SpvOpDecorate:
+			if(wc >= 4 && ins[2] == SpvDecorationSpecId && ID(1)) {
+				info[ins[1]].specid = ins[3];
+				continue;	// Drop it, since it won't be a spec any more
+			}
+			break;
+		case SpvOpTypeBool:
+			if(ID(1)) info[ins[1]].type = T_BOOL;
+			break;
+		case SpvOpTypeInt:
+			if(ID(1) && wc >= 4) info[ins[1]] = (idinfo){
+				.type = T_INT, .width = ins[2], .sign = ins[3],
+				.specid = info[ins[1]].specid,
+			};
+			break;
+		case SpvOpTypeFloat:
+			if(ID(1) && wc >= 3) info[ins[1]] = (idinfo){
+				.type = T_FLOAT, .width = ins[2],
+				.specid = info[ins[1]].specid,
+			};
+			break;
+
+		case SpvOpSpecConstantTrue:
+		case SpvOpSpecConstantFalse:
+			if(!ID(2) || !ID(1)) break;
+			{
+				idinfo* c = &info[ins[2]];
+				uint64_t v = op == SpvOpSpecConstantTrue;
+				specValue(si, c->specid, &v);
+				ins[0] = (wc << SpvWordCountShift)
+					| (v ? SpvOpConstantTrue : SpvOpConstantFalse);
+				c->rtype = ins[1];
+				c->known = true;
+				c->val = !!v;
+				c->constant = true;
+			}
+			break;
+		case SpvOpConstantTrue:
+		case SpvOpConstantFalse:
+			if(!ID(2) || !ID(1)) break;
+			info[ins[2]].rtype = ins[1];
+			info[ins[2]].known = true;
+			info[ins[2]].val = op == SpvOpConstantTrue;
+			info[ins[2]].constant = true;
+			break;
+		case SpvOpConstantComposite:
+		case SpvOpConstantNull:
+		case SpvOpConstantSampler:
+			if(ID(2)) info[ins[2]].constant = true;
+			break;
+		case SpvOpSpecConstant:
+		case SpvOpConstant:
+			if(!ID(2) || !ID(1) || wc < 4) break;
+			{
+				idinfo* c = &info[ins[2]];
+				uint64_t v = 0;
+				memcpy(&v, &ins[3], (wc > 4 ? 2 : 1)*sizeof(uint32_t));
+				if(op == SpvOpSpecConstant && specValue(si, c->specid, &v)) {
+					v = encode(v, &info[ins[1]]);
+					memcpy(&ins[3], &v, (wc > 4 ? 2 : 1)*sizeof(uint32_t));
+				}
+				ins[0] = (wc << SpvWordCountShift) | SpvOpConstant;
+				c->rtype = ins[1];
+				c->known = info[ins[1]].type == T_INT
+					|| info[ins[1]].type == T_BOOL;
+				c->val = v;
+				c->constant = true;
+			}
+			break;
+		case SpvOpSpecConstantComposite:
+			// Only if none of its parts are still spec constants, which
+			// happens when an OpSpecConstantOp couldn't be folded.
+			if(!ID(2)) break;
+			{
+				bool all = true;
+				for(uint32_t i=3; i < wc; i++)
+					if(ins[i] >= bound || !info[ins[i]].constant) all = false;
+				if(!all) break;
+				ins[0] = (wc << SpvWordCountShift) | SpvOpConstantComposite;
+				info[ins[2]].constant = true;
+			}
+			break;
+		case SpvOpSpecConstantOp:
+			if(!ID(2) || !ID(1) || wc < 4) break;
+			{
+				uint64_t v;
+				if(!fold(ins, info, bound, &v)) break;
+				idinfo* c = &info[ins[2]];
+				c->rtype = ins[1];
+				c->known = true;
+				c->val = v;
+				c->constant = true;
+				if(info[ins[1]].type == T_BOOL) {
+					code[out] = 3 << SpvWordCountShift
+						| (v ? SpvOpConstantTrue : SpvOpConstantFalse);
+					code[out+1] = ins[1];
+					code[out+2] = ins[2];
+					out += 3;
+				} else {
+					uint32_t w = info[ins[1]].width > 32 ? 2 : 1;
+					uint32_t d[] = {ins[1], ins[2]};
+					v = encode(v, &info[ins[1]]);
+					code[out] = (3+w) << SpvWordCountShift | SpvOpConstant;
+					memcpy(&code[out+1], d, sizeof(d));
+					memcpy(&code[out+3], &v, w*sizeof(uint32_t));
+					out += 3+w;
+				}
+			}
+			continue;
+		}
+#undef ID
+
+		memmove(&code[out], ins, wc*sizeof(uint32_t));
+		out += wc;
+	}
+
+	// The Functions stay as they are, just moved down.
+	memmove(&code[out], &code[here], (size-here)*sizeof(uint32_t));
+	out += size-here;
+	free(info);
+	return out;
+}
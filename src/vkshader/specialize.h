@@ -0,0 +1,31 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifndef H_vkshader_specialize
+#define H_vkshader_specialize
+
+#include <vivacious/vulkan.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Turn the specialization constants of the SPIR-V module in <code> into
+// normal constants, using the values in <si> or the defaults. Whatever
+// OpSpecConstantOps can be worked out here are folded too. Works in place,
+// and returns the new size in words.
+size_t _vVvks_specialize(uint32_t* code, size_t size,
+	const VkSpecializationInfo* si);
+
+#endif // H_vkshader_specialize
@@ -23,58 +23,825 @@
 #include "spirv/1.2/spirv.h"
 #include "vkshader/mcopy.h"
 #include "vkshader/sections.h"
+#include "vkshader/optimize.h"
+#include "vkshader/specialize.h"
+#include "vkshader/reflect.h"
+#include "vkshader/pack.h"
+#include "workpool.h"
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
+
+// A directory being watched for changes to the files in it.
+typedef struct {
+	int wd;
+	char* path;
+} watchdir;
 
 struct VvVkS_Bank {
-	VvVkS_Component* components;
+	// Open-addressed table of Components, keyed on the hash of their code.
+	VvVkS_Component** table;
+	size_t tablesize, count;	// <tablesize> is always a power of 2
+
+	// Components loaded from files. Those can be reloaded in place, so they
+	// are kept out of <table> and only shared with loads of the same path.
+	VvVkS_Component** files;
+	size_t filecnt, filecap;
+	_vVpool* pool;	// Workers for batched constructs, made when first needed
+	int level;	// How hard construct tries to shrink its results
+	int compress;	// Whether new Components should be kept packed
+	pthread_mutex_t lock;	// Guards the <finished> of every Pending
+	pthread_cond_t finished;
+	int notify;	// inotify fd for the Watches, or -1 before the first one
+	watchdir* dirs;
+	size_t dircnt;
+	VvVkS_Watch* watches;	// Every Watch, as a list
+};
+
+struct VvVkS_Pending {
+	const Vv* V;
+	VvVkS_Bank* bank;
+	VkDevice dev;
+	void (*done)(void*, VkShaderModule, VkResult);
+	void* udata;
+	int finished;
+	VkResult result;
+	VkShaderModule sm;
+	size_t nc;
+	VvVkS_Component* cs[];
+};
+
+struct VvVkS_Watch {
+	VvVkS_Watch *prev, *next;
+	VkDevice dev;
+	void (*done)(void*, VkShaderModule, VkResult);
+	void* udata;
+	int dirty;	// Set while its waiting to be rebuilt
+	VkResult result;
+	VkShaderModule sm;
+	size_t nc;
+	VvVkS_Component* cs[];
+};
+
+// Sections of a SPIR-V module, in the order they appear. The last covers
+// the function definitions, that is, the Functions with bodies.
+enum {
+	SECT_CAPS, SECT_EXTS, SECT_IMPORTS, SECT_MEMMODEL, SECT_EPS, SECT_EMS,
+	SECT_DEBUGA, SECT_DEBUGB, SECT_ANNOTATE, SECT_TYPES, SECT_DECLS,
+	SECT_FUNCS, SECT_END,
 };
 
+typedef struct {
+	uint32_t id;	// Result <id> of the OpFunction
+	size_t start, end;	// From the OpFunction to just past the OpFunctionEnd
+	int ep;	// Whether this is the chosen EP for some ExecutionModel
+} funcinfo;
+
+typedef struct {
+	size_t cnt;
+	size_t* at;	// Offsets of OpExecutionMode(Id)s for a particular EP
+} modelist;
+
 struct VvVkS_Component {
-	VvVkS_Component* next;
+	uint64_t hash;	// Of <code>, for finding duplicates
+	size_t refs;	// How many loads this has been returned from
 	size_t size;
-	uint32_t* code;
+	const uint32_t* code;	// NULL if the code is packed
+
+	// Where <code> lives, and thus how to get rid of it later.
+	enum { CODE_OWNED, CODE_BORROWED, CODE_MAPPED, CODE_PACKED } storage;
+	uint8_t* packed;	// The code, as _vVvks_pack has it
+	size_t packedsize;
+
+	// Everything below is worked out once by indexShader, at load time.
+	size_t sects[SECT_END+1];	// Start of each section, SECT_END is <size>
+	size_t eps[7];	// The chosen OpEntryPoint for each ExecutionModel, or 0
+	size_t epfuncs[7];	// The OpFunction for each of those EPs, or 0
+	size_t compats[7];	// The "compat_" twin of each of those EPs, or 0
+	modelist modes[7], compatmodes[7];	// The EMs for the EPs and twins
+	uint32_t voidtype, voidfunc;	// OpTypeVoid and void() <id>s, or 0
+	size_t funccnt;
+	funcinfo* funcs;	// Every Function in SECT_FUNCS, in order
+	VvVkS_Reflection* reflection;
+	VvVkS_Reflection* reflected;	// What <reflection> points into, after a reload
+	int unique;	// Set if no mergeable instruction duplicates another
+
+	// For Components loaded from a file, what is needed to reload it.
+	char* path;	// NULL if it didn't come from a file
+	int wd;	// The watch on the file's directory, or -1
+	int changed;	// Set while its waiting to be reloaded
+	VvVkS_Watch** users;	// The Watches that use it
+	size_t usercnt, usercap;
+	int derived;	// Set if constructComponent made it from any of these
 };
 
 static VvVkS_Bank* createBank(const Vv* V) {
 	VvVkS_Bank* b = malloc(sizeof(VvVkS_Bank));
-	b->components = NULL;
+	b->tablesize = 64;
+	b->table = calloc(b->tablesize, sizeof(VvVkS_Component*));
+	b->count = 0;
+	b->files = NULL;
+	b->filecnt = b->filecap = 0;
+	b->pool = NULL;
+	b->level = OPT_NONE;
+	b->compress = 0;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->finished, NULL);
+	b->notify = -1;
+	b->dirs = NULL;
+	b->dircnt = 0;
+	b->watches = NULL;
 	return b;
 }
 
+static void freeCode(VvVkS_Component* c) {
+	if(c->storage == CODE_OWNED) free((uint32_t*)c->code);
+	else if(c->storage == CODE_MAPPED)
+		munmap((uint32_t*)c->code, c->size*sizeof(uint32_t));
+	else if(c->storage == CODE_PACKED) free(c->packed);
+}
+
+static void freeIndex(VvVkS_Component* c) {
+	free(c->funcs);
+	free(c->reflection);
+	free(c->reflected);
+	for(int em=0; em < 7; em++) {
+		free(c->modes[em].at);
+		free(c->compatmodes[em].at);
+	}
+}
+
+static void freeComponent(VvVkS_Component* c) {
+	freeCode(c);
+	freeIndex(c);
+	free(c->path);
+	free(c->users);
+	free(c);
+}
+
 static void destroyBank(const Vv* V, VvVkS_Bank* b) {
-	for(VvVkS_Component* c = b->components; c;) {
-		VvVkS_Component* n = c->next;
-		free(c->code);
-		free(c);
-		c = n;
+	// Anything still running in the background needs the Components.
+	if(b->pool) _vVpooldestroy(b->pool);
+	for(size_t i=0; i < b->tablesize; i++)
+		if(b->table[i]) freeComponent(b->table[i]);
+	free(b->table);
+	for(size_t i=0; i < b->filecnt; i++) freeComponent(b->files[i]);
+	free(b->files);
+	while(b->watches) {
+		VvVkS_Watch* w = b->watches;
+		b->watches = w->next;
+		free(w);
 	}
+#ifdef __linux__
+	if(b->notify >= 0) close(b->notify);
+#endif
+	for(size_t i=0; i < b->dircnt; i++) free(b->dirs[i].path);
+	free(b->dirs);
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->finished);
 	free(b);
 }
 
+// Check that <code> looks like SPIR-V we can work with.
+static int checkCode(const uint32_t* code, size_t bytes) {
+	if(bytes % sizeof(uint32_t) != 0 || bytes < 5*sizeof(uint32_t)) return 0;
+	if(code[0] != SpvMagicNumber) return 0;
+	if(code[1] > SpvVersion) return 0;
+	return 1;
+}
+
+// An OpEntryPoint named "compat_<name>" lists the EMs that the EP <name> can
+// also run under, see construct's docs.
+static int isCompat(const uint32_t* ep) {
+	size_t len = ((ep[0] >> SpvWordCountShift) - 3)*sizeof(uint32_t);
+	return len > 7 && strncmp((const char*)&ep[3], "compat_", 7) == 0;
+}
+
+static int isCompatOf(const uint32_t* ep, const uint32_t* of) {
+	size_t len = ((of[0] >> SpvWordCountShift) - 3)*sizeof(uint32_t);
+	return ep[1] == of[1] && isCompat(ep)
+		&& strncmp((const char*)&ep[3] + 7, (const char*)&of[3], len) == 0;
+}
+
+static void addMode(modelist* l, size_t at) {
+	l->at = realloc(l->at, (l->cnt+1)*sizeof(size_t));
+	l->at[l->cnt++] = at;
+}
+
+// Walk the Component's code once, filling in the section offsets, EPs and
+// Functions. Returns 0 if the code isn't laid out the way construct expects.
+static int indexShader(VvVkS_Component* c) {
+	const uint32_t* code = c->code;
+	size_t here = 5;
+#define OP (code[here] & SpvOpCodeMask)
+#define WC (code[here] >> SpvWordCountShift)
+#define EOI (here >= c->size)
+#define NEXT (here += WC)
+#define SECTION(S, COND) for(c->sects[S] = here; !EOI && (COND); NEXT)
+
+	c->funccnt = 0;
+	c->funcs = NULL;
+	for(int em=0; em < 7; em++)
+		c->modes[em] = c->compatmodes[em] = (modelist){0, NULL};
+
+	// The whole thing has to be walkable, so check the word counts first.
+	for(; !EOI; NEXT) if(WC == 0 || here+WC > c->size) return 0;
+
+	// The merge trusts the operands and <id>s it copies, so check them too.
+	uint32_t bound = code[3];
+	iddata* ids = bound ? calloc(bound, sizeof(iddata)) : NULL;
+	if(!ids) return 0;
+	for(here = 5; !EOI; NEXT)
+		if(!_vVvks_check(&code[here], bound, ids)) break;
+	free(ids);
+	if(!EOI) return 0;
+	here = 5;
+
+	SECTION(SECT_CAPS, OP == SpvOpCapability);
+	SECTION(SECT_EXTS, OP == SpvOpExtension);
+	SECTION(SECT_IMPORTS, OP == SpvOpExtInstImport);
+	SECTION(SECT_MEMMODEL, OP == SpvOpMemoryModel);
+	if(here - c->sects[SECT_MEMMODEL] != 3) return 0;
+
+	for(int em=0; em < 7; em++)
+		c->eps[em] = c->epfuncs[em] = c->compats[em] = 0;
+	SECTION(SECT_EPS, OP == SpvOpEntryPoint) {
+		if(WC < 4 || code[here+1] >= 7) continue;
+		if(!isCompat(&code[here]) && !c->eps[code[here+1]])
+			c->eps[code[here+1]] = here;
+	}
+	for(size_t at = c->sects[SECT_EPS]; at < here;
+		at += code[at] >> SpvWordCountShift) {
+
+		uint32_t em = code[at+1];
+		if(em < 7 && c->eps[em] && !c->compats[em]
+			&& isCompatOf(&code[at], &code[c->eps[em]]))
+			c->compats[em] = at;
+	}
+
+	SECTION(SECT_EMS, OP == SpvOpExecutionMode
+		|| OP == SpvOpExecutionModeId) {
+
+		if(WC < 3) return 0;
+		for(int em=0; em < 7; em++) {
+			if(c->eps[em] && code[here+1] == code[c->eps[em]+2])
+				addMode(&c->modes[em], here);
+			if(c->compats[em] && code[here+1] == code[c->compats[em]+2])
+				addMode(&c->compatmodes[em], here);
+		}
+	}
+	SECTION(SECT_DEBUGA, SEC_DEBUGA);
+	SECTION(SECT_DEBUGB, SEC_DEBUGB);
+	SECTION(SECT_ANNOTATE, SEC_ANNOTATE);
+
+	c->voidtype = c->voidfunc = 0;
+	SECTION(SECT_TYPES, SEC_TYPES) {
+		if(OP == SpvOpTypeVoid && !c->voidtype)
+			c->voidtype = code[here+1];
+		else if(OP == SpvOpTypeFunction && WC == 3 && !c->voidfunc
+			&& c->voidtype && code[here+2] == c->voidtype)
+			c->voidfunc = code[here+1];
+	}
+
+	// Declarations run until the first Function that has a body.
+	c->sects[SECT_DECLS] = here;
+	size_t fstart = c->size;
+	for(; !EOI; NEXT) {
+		if(OP == SpvOpFunction) fstart = here;
+		else if(OP == SpvOpLabel) break;
+	}
+	here = EOI ? c->size : fstart;
+
+	// Then the definitions, which should be nothing but Functions.
+	c->sects[SECT_FUNCS] = here;
+	size_t fcap = 0;
+	while(!EOI) {
+		if(OP != SpvOpFunction || WC < 3) return 0;
+		if(c->funccnt == fcap) {
+			fcap = fcap ? 2*fcap : 8;
+			c->funcs = realloc(c->funcs, fcap*sizeof(funcinfo));
+		}
+		funcinfo* f = &c->funcs[c->funccnt++];
+		f->id = code[here+2];
+		f->start = here;
+		f->ep = 0;
+		while(!EOI && OP != SpvOpFunctionEnd) NEXT;
+		if(EOI) return 0;
+		NEXT;
+		f->end = here;
+	}
+	c->sects[SECT_END] = here;
+
+	// Now match the EPs up with their Functions
+	for(int em=0; em < 7; em++) {
+		if(!c->eps[em]) continue;
+		uint32_t id = code[c->eps[em]+2];
+		for(size_t i=0; i < c->funccnt; i++)
+			if(c->funcs[i].id == id) {
+				c->epfuncs[em] = c->funcs[i].start;
+				c->funcs[i].ep = 1;
+				break;
+			}
+		if(!c->epfuncs[em]) return 0;
+	}
+	return 1;
+#undef OP
+#undef WC
+#undef EOI
+#undef NEXT
+#undef SECTION
+}
+
+static uint64_t hashCode(const uint32_t* code, size_t size) {
+	uint64_t h = 0xcbf29ce484222325;
+	for(size_t i=0; i < size; i++) {
+		h = (h ^ code[i]) * 0x100000001b3;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+// Get at the code for <c>. If its packed, it gets unpacked into a new buffer
+// which should be freed with dropCode.
+static const uint32_t* getCode(const VvVkS_Component* c) {
+	if(c->code) return c->code;
+	uint32_t* code = malloc(c->size*sizeof(uint32_t));
+	_vVvks_unpack(c->packed, c->packedsize, code);
+	return code;
+}
+
+static void dropCode(const VvVkS_Component* c, const uint32_t* code) {
+	if(code != c->code) free((uint32_t*)code);
+}
+
+static int sameCode(const VvVkS_Component* c, const uint32_t* code) {
+	const uint32_t* cc = getCode(c);
+	int same = memcmp(cc, code, c->size*sizeof(uint32_t)) == 0;
+	dropCode(c, cc);
+	return same;
+}
+
+// Find the Component with exactly this <code>, or the slot it would go in.
+static size_t findSlot(const VvVkS_Bank* b, const uint32_t* code,
+	size_t size, uint64_t hash) {
+
+	size_t mask = b->tablesize - 1;
+	for(size_t i = hash & mask;; i = (i+1) & mask) {
+		const VvVkS_Component* c = b->table[i];
+		if(!c) return i;
+		if(c->hash == hash && c->size == size && sameCode(c, code)) return i;
+	}
+}
+
+static void growTable(VvVkS_Bank* b) {
+	VvVkS_Component** old = b->table;
+	size_t oldsize = b->tablesize;
+	b->tablesize *= 2;
+	b->table = calloc(b->tablesize, sizeof(VvVkS_Component*));
+	for(size_t i=0; i < oldsize; i++)
+		if(old[i]) {
+			size_t mask = b->tablesize - 1, j = old[i]->hash & mask;
+			while(b->table[j]) j = (j+1) & mask;
+			b->table[j] = old[i];
+		}
+	free(old);
+}
+
+static void removeSlot(VvVkS_Bank* b, size_t i) {
+	// Shift back anything after it that would have liked to be earlier.
+	size_t mask = b->tablesize - 1;
+	b->table[i] = NULL;
+	b->count--;
+	for(size_t j = (i+1) & mask; b->table[j]; j = (j+1) & mask) {
+		size_t want = b->table[j]->hash & mask;
+		if(((j - want) & mask) >= ((j - i) & mask)) {
+			b->table[i] = b->table[j];
+			b->table[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+// If the Bank already has a Component for <code>, take another reference to
+// it. Otherwise return NULL, with *<hash> set for addComponent.
+static VvVkS_Component* reuseComponent(VvVkS_Bank* b, const uint32_t* code,
+	size_t bytes, uint64_t* hash) {
+
+	size_t size = bytes / sizeof(uint32_t);
+	*hash = hashCode(code, size);
+	VvVkS_Component* c = b->table[findSlot(b, code, size, *hash)];
+	if(c) c->refs++;
+	return c;
+}
+
+// Add a new Component to the Bank, which takes ownership as <storage> says.
+// If <path> is given it goes in the Bank's files, otherwise in its table.
+static VvVkS_Component* addComponent(VvVkS_Bank* b, const uint32_t* code,
+	size_t bytes, int storage, uint64_t hash, const char* path) {
+
+	VvVkS_Component* c = malloc(sizeof(VvVkS_Component));
+	c->hash = hash;
+	c->refs = 1;
+	c->size = bytes / sizeof(uint32_t);
+	c->code = code;
+	c->storage = storage;
+	c->packed = NULL;
+	c->reflection = NULL;
+	c->reflected = NULL;
+	c->unique = 0;
+	c->path = NULL;
+	c->wd = -1;
+	c->changed = 0;
+	c->users = NULL;
+	c->usercnt = c->usercap = 0;
+	c->derived = 0;
+	if(!indexShader(c)) {
+		freeComponent(c);
+		return NULL;
+	}
+	c->reflection = _vVvks_reflect(c->code, c->size);
+
+	if(path) {
+		c->path = strdup(path);
+		if(b->filecnt == b->filecap) {
+			b->filecap = b->filecap ? 2*b->filecap : 8;
+			b->files = realloc(b->files,
+				b->filecap*sizeof(VvVkS_Component*));
+		}
+		b->files[b->filecnt++] = c;
+	} else {
+		if(2*(b->count+1) > b->tablesize) growTable(b);
+		b->table[findSlot(b, code, c->size, hash)] = c;
+		b->count++;
+	}
+
+	// Now that everything that needs the code at hand is done, pack it.
+	if(b->compress) {
+		uint8_t* packed = _vVvks_pack(c->code, c->size, &c->packedsize);
+		freeCode(c);
+		c->code = NULL;
+		c->storage = CODE_PACKED;
+		c->packed = packed;
+	}
+	return c;
+}
+
+// The file under a mapping is about to change, or the memory <c> borrowed may
+// go away before <c> does, so get a copy of the code.
+static void ownCode(VvVkS_Component* c) {
+	if(c->storage != CODE_MAPPED && c->storage != CODE_BORROWED) return;
+	uint32_t* code = malloc(c->size*sizeof(uint32_t));
+	memcpy(code, c->code, c->size*sizeof(uint32_t));
+	freeCode(c);
+	c->code = code;
+	c->storage = CODE_OWNED;
+}
+
 static VvVkS_Component* loadShader(const Vv* V, VvVkS_Bank* b,
 	VkShaderModuleCreateInfo* smci) {
 
 	if(smci->sType != VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO)
 		return NULL;
-	if(smci->pCode[1] > SpvVersion) return NULL;
-	VvVkS_Component* c = malloc(sizeof(VvVkS_Component));
-	c->next = b->components;
-	c->size = smci->codeSize / 4;
-	c->code = malloc(smci->codeSize);
-	memcpy(c->code, smci->pCode, smci->codeSize);
-	b->components = c;
-	return c;
+	if(!checkCode(smci->pCode, smci->codeSize)) return NULL;
+	uint64_t hash;
+	VvVkS_Component* c = reuseComponent(b, smci->pCode, smci->codeSize, &hash);
+	if(c) {
+		// The borrower doesn't know this one needs its memory too
+		ownCode(c);
+		return c;
+	}
+	uint32_t* code = malloc(smci->codeSize);
+	memcpy(code, smci->pCode, smci->codeSize);
+	return addComponent(b, code, smci->codeSize, CODE_OWNED, hash, NULL);
 }
 
-static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
-	size_t nc, VvVkS_Component** cs, VkShaderModule* sm) {
+static VvVkS_Component* borrowShader(const Vv* V, VvVkS_Bank* b,
+	VkShaderModuleCreateInfo* smci) {
+
+	if(smci->sType != VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO)
+		return NULL;
+	if(!checkCode(smci->pCode, smci->codeSize)) return NULL;
+	uint64_t hash;
+	VvVkS_Component* c = reuseComponent(b, smci->pCode, smci->codeSize, &hash);
+	if(c) {
+		if(c->code != smci->pCode) ownCode(c);
+		return c;
+	}
+	return addComponent(b, smci->pCode, smci->codeSize, CODE_BORROWED, hash,
+		NULL);
+}
+
+static VvVkS_Component* loadShaderFile(const Vv* V, VvVkS_Bank* b,
+	const char* path) {
+
+	for(size_t i=0; i < b->filecnt; i++)
+		if(strcmp(b->files[i]->path, path) == 0) {
+			b->files[i]->refs++;
+			return b->files[i];
+		}
+
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < 5*sizeof(uint32_t)) {
+		close(fd);
+		return NULL;
+	}
+
+	// The mapping stays valid after the close, and is only ever read from.
+	void* m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED) return NULL;
+	if(!checkCode(m, st.st_size)) {
+		munmap(m, st.st_size);
+		return NULL;
+	}
+	return addComponent(b, m, st.st_size, CODE_MAPPED,
+		hashCode(m, st.st_size / sizeof(uint32_t)), path);
+}
+
+static void unloadShader(const Vv* V, VvVkS_Bank* b, VvVkS_Component* c) {
+	if(--c->refs > 0) return;
+	if(c->path) {
+		size_t i = 0;
+		while(b->files[i] != c) i++;
+		b->files[i] = b->files[--b->filecnt];
+	} else {
+		size_t mask = b->tablesize - 1, i = c->hash & mask;
+		while(b->table[i] != c) i = (i+1) & mask;
+		removeSlot(b, i);
+	}
+	freeComponent(c);
+}
+
+static const VvVkS_Reflection* reflect(const Vv* V, VvVkS_Bank* b,
+	VvVkS_Component* c) {
+
+	return c->reflection;
+}
+
+static void destroyReflection(const Vv* V, VvVkS_Bank* b,
+	VvVkS_Reflection* r) {
+
+	free(r);
+}
+
+// Some EMs are mutually exclusive, so they are handled as a group. Each group
+// is named by one of its members, and may only show up once on the result.
+static uint32_t modeGroup(uint32_t mode) {
+	switch(mode) {
+	case SpvExecutionModeOriginLowerLeft:
+		return SpvExecutionModeOriginUpperLeft;
+	case SpvExecutionModeDepthLess:
+	case SpvExecutionModeDepthUnchanged:
+		return SpvExecutionModeDepthGreater;
+	case SpvExecutionModeSpacingFractionalEven:
+	case SpvExecutionModeSpacingFractionalOdd:
+		return SpvExecutionModeSpacingEqual;
+	case SpvExecutionModeVertexOrderCcw:
+		return SpvExecutionModeVertexOrderCw;
+	case SpvExecutionModeInputLines:
+	case SpvExecutionModeInputLinesAdjacency:
+	case SpvExecutionModeTriangles:
+	case SpvExecutionModeInputTrianglesAdjacency:
+	case SpvExecutionModeQuads:
+	case SpvExecutionModeIsolines:
+		return SpvExecutionModeInputPoints;
+	case SpvExecutionModeOutputLineStrip:
+	case SpvExecutionModeOutputTriangleStrip:
+		return SpvExecutionModeOutputPoints;
+	case SpvExecutionModeLocalSizeId:
+		return SpvExecutionModeLocalSize;
+	case SpvExecutionModeLocalSizeHintId:
+		return SpvExecutionModeLocalSizeHint;
+	default: return mode;
+	}
+}
+
+// How a group of EMs is merged. Some can always be added without changing
+// how a Component executes, and some are hints that can always be dropped.
+// The rest have to be reconciled using the "compat_" EPs.
+enum { MODE_ADDABLE, MODE_DROPPABLE, MODE_EXACT };
+static int modePolicy(uint32_t group) {
+	switch(group) {
+	case SpvExecutionModeDepthReplacing:
+	case SpvExecutionModeContractionOff:
+		return MODE_ADDABLE;
+	case SpvExecutionModeDepthGreater:
+	case SpvExecutionModeLocalSizeHint:
+	case SpvExecutionModeVecTypeHint:
+		return MODE_DROPPABLE;
+	default: return MODE_EXACT;
+	}
+}
+
+typedef struct {
+	const uint32_t* ins;	// The OpExecutionMode(Id) itself
+	uint32_t shift;	// The id shift of its Component
+	size_t csind;	// Which Component its from
+} modeinst;
+
+// Check if two EMs are the same, ignoring which EP they're for.
+static int sameMode(const modeinst* a, const modeinst* b, const iddata ids[]) {
+	if(a->ins[0] != b->ins[0] || a->ins[2] != b->ins[2]) return 0;
+	int isid = (a->ins[0] & SpvOpCodeMask) == SpvOpExecutionModeId;
+	for(uint32_t i=3; i < a->ins[0] >> SpvWordCountShift; i++) {
+		if(isid) {
+			if(ids[a->ins[i]+a->shift].map != ids[b->ins[i]+b->shift].map)
+				return 0;
+		} else if(a->ins[i] != b->ins[i]) return 0;
+	}
+	return 1;
+}
+
+// Check if the "compat_" twin of Component <c>'s EP for <em> enables <m>.
+static int compatMode(VvVkS_Component* c, const uint32_t* code,
+	SpvExecutionModel em, uint32_t shift, const modeinst* m,
+	const iddata ids[]) {
+
+	for(size_t i=0; i < c->compatmodes[em].cnt; i++) {
+		modeinst cm = {&code[c->compatmodes[em].at[i]], shift};
+		if(sameMode(&cm, m, ids)) return 1;
+	}
+	return 0;
+}
+
+// Check if every Component is fine with <m> for its EP of <em>, given its
+// <own> EM from the same group. If <m> is NULL, the group is left out.
+static int allAccept(SpvExecutionModel em, size_t nc, VvVkS_Component** cs,
+	const uint32_t* const srcs[], const uint32_t shifts[],
+	const modeinst* own[], const modeinst* m, const iddata ids[]) {
+
+	for(size_t i=0; i<nc; i++) {
+		if(!cs[i]->eps[em]) continue;
+		if(m && own[i] && sameMode(own[i], m, ids)) continue;
+		if(!m && !own[i]) continue;
+		if(!compatMode(cs[i], srcs[i], em, shifts[i], m ? m : own[i], ids))
+			return 0;
+	}
+	return 1;
+}
+
+// Write <m> as an OpExecutionMode(Id) for <target> into <out>. Returns the
+// number of words written.
+static uint32_t writeMode(const modeinst* m, uint32_t target,
+	const iddata ids[], uint32_t* out) {
+
+	uint32_t wc = m->ins[0] >> SpvWordCountShift;
+	int isid = (m->ins[0] & SpvOpCodeMask) == SpvOpExecutionModeId;
+	out[0] = m->ins[0];
+	out[1] = target;
+	out[2] = m->ins[2];
+	for(uint32_t i=3; i<wc; i++)
+		out[i] = isid ? ids[m->ins[i]+m->shift].map : m->ins[i];
+	return wc;
+}
+
+// Write the EMs of <group> that every Component is fine with, other than the
+// <pick>ed one, for the "compat_" twin <twin> into <out>. The options are
+// in <all> from <first> on. The <pick> is written too if the group could
+// have been left out. Returns the number of words written.
+static long twinModes(SpvExecutionModel em, uint32_t twin, uint32_t group,
+	size_t nc, VvVkS_Component** cs, const uint32_t* const srcs[],
+	const uint32_t shifts[], const iddata ids[], const modeinst* own[],
+	const modeinst* all, size_t first, size_t cnt, const modeinst* pick,
+	uint32_t* out) {
+
+	long here = 0;
+	if(pick && allAccept(em, nc, cs, srcs, shifts, own, NULL, ids))
+		here += writeMode(pick, twin, ids, &out[here]);
+	for(size_t j=first; j<cnt; j++) {
+		const modeinst* m = &all[j];
+		if(!m->ins || modeGroup(m->ins[2]) != group) continue;
+		if(pick && sameMode(m, pick, ids)) continue;
+		int seen = 0;
+		for(size_t i=first; i<j && !seen; i++)
+			if(all[i].ins && sameMode(&all[i], m, ids)) seen = 1;
+		if(!seen && allAccept(em, nc, cs, srcs, shifts, own, m, ids))
+			here += writeMode(m, twin, ids, &out[here]);
+	}
+	return here;
+}
+
+// Merge the EMs for the chosen EPs of <em>, writing OpExecutionMode(Id)s for
+// the composite EP <target> into <out>. If <twin> isn't 0, the EMs every
+// Component could also run under are written for it, so that it can be the
+// "compat_" twin of <target>. Returns the number of words written, or -1 if
+// no set of EMs works for every Component.
+static long mergeModes(SpvExecutionModel em, uint32_t target, uint32_t twin,
+	size_t nc, VvVkS_Component** cs, const uint32_t* const srcs[],
+	const uint32_t shifts[], const iddata ids[], uint32_t* out) {
+
+	// Every Component's own EMs, then a gap for leaving the group out, then
+	// the EMs their twins enable.
+	size_t total = 0, cnt = 0;
+	for(size_t i=0; i<nc; i++) {
+		total += cs[i]->modes[em].cnt;
+		cnt += cs[i]->compatmodes[em].cnt;
+	}
+	if(total == 0 && (!twin || cnt == 0)) return 0;
+	cnt += total + 1;
+	modeinst all[cnt];
+	total = 0;
+	for(size_t i=0; i<nc; i++)
+		for(size_t j=0; j < cs[i]->modes[em].cnt; j++)
+			all[total++] = (modeinst){
+				&srcs[i][cs[i]->modes[em].at[j]], shifts[i], i};
+	all[total] = (modeinst){NULL, 0, 0};
+	cnt = total + 1;
+	for(size_t i=0; i<nc; i++)
+		for(size_t j=0; j < cs[i]->compatmodes[em].cnt; j++)
+			all[cnt++] = (modeinst){
+				&srcs[i][cs[i]->compatmodes[em].at[j]], shifts[i], i};
+
+	long here = 0;
+	for(size_t k=0; k < (twin ? cnt : total); k++) {
+		if(!all[k].ins) continue;
+		uint32_t group = modeGroup(all[k].ins[2]);
+		int seen = 0;
+		for(size_t j=0; j<k; j++)
+			if(all[j].ins && modeGroup(all[j].ins[2]) == group) seen = 1;
+		if(seen) continue;	// Only handle each group once
+
+		// Each Component's own EM from this group, if it has one.
+		const modeinst* own[nc];
+		for(size_t i=0; i<nc; i++) own[i] = NULL;
+		for(size_t j=k; j < total; j++)
+			if(modeGroup(all[j].ins[2]) == group && !own[all[j].csind])
+				own[all[j].csind] = &all[j];
+
+		// Only the twins have this group, so there is nothing to pick, but
+		// the new twin still has to say what everyone can run under.
+		if(k > total) {
+			if(modePolicy(group) == MODE_EXACT)
+				here += twinModes(em, twin, group, nc, cs, srcs, shifts, ids,
+					own, all, k, cnt, NULL, &out[here]);
+			continue;
+		}
+
+		const modeinst* pick = NULL;
+		switch(modePolicy(group)) {
+		case MODE_ADDABLE:
+			pick = &all[k];
+			break;
+		case MODE_DROPPABLE:
+			// Keep it only if every Component agrees on it.
+			pick = &all[k];
+			for(size_t i=0; i<nc; i++)
+				if(cs[i]->eps[em] && (!own[i] || !sameMode(own[i], pick, ids)))
+					pick = NULL;
+			break;
+		case MODE_EXACT: {
+			// Try each option in order: the Components' own EMs, not having
+			// it at all, and then the ones their twins enable. A Component
+			// is fine with an option if its the same as its own, or its twin
+			// enables it (or enables the dropped one, if the option is to
+			// leave the group out).
+			int found = 0;
+			for(size_t j=k; j < cnt && !found; j++) {
+				const modeinst* m = all[j].ins ? &all[j] : NULL;
+				if(m && modeGroup(m->ins[2]) != group) continue;
+				if(allAccept(em, nc, cs, srcs, shifts, own, m, ids)) {
+					pick = m;
+					found = 1;
+				}
+			}
+			if(!found) return -1;
+			if(twin)
+				here += twinModes(em, twin, group, nc, cs, srcs, shifts, ids,
+					own, all, k, cnt, pick, &out[here]);
+			break;
+		}
+		}
+
+		if(pick) here += writeMode(pick, target, ids, &out[here]);
+	}
+	return here;
+}
+
+// Does the work for merge, with <srcs> holding the code for each Component.
+static VkResult mergeCode(size_t nc, VvVkS_Component** cs,
+	const uint32_t* const srcs[], int twins, uint32_t** code, size_t* size) {
 
 	// 5+1+2 (header) + 1+1 (footer) for each EPs function,
 	// and 4 for each component in each EP.
 	size_t sz = (10+4*nc)*7;
 	for(size_t i=0; i<nc; i++) sz += cs[i]->size;
+	// The twins have 6 for the EP and 5+2+1+1 for the Function, and their
+	// EMs may repeat the ones picked for the EPs.
+	if(twins) {
+		sz += 15*7;
+		for(size_t i=0; i<nc; i++)
+			sz += cs[i]->sects[SECT_EMS+1] - cs[i]->sects[SECT_EMS];
+	}
 	uint32_t* out = malloc(sz*sizeof(uint32_t));
 	uint32_t* tmp = malloc(sz*sizeof(uint32_t));
 
@@ -82,11 +849,12 @@ static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
 	shifts[0] = 0;
 	size_t heres[nc];
 	for(size_t i=0; i<nc; i++) {
-		shifts[i+1] = shifts[i] + cs[i]->code[3];
+		shifts[i+1] = shifts[i] + srcs[i][3];
 		heres[i] = 5;	// Instructions start on index 5
 	}
 
-	iddata ids[shifts[nc]];
+	// This can get big, and we may be on a worker's stack, so use the heap.
+	iddata* ids = malloc(shifts[nc]*sizeof(iddata));
 	for(uint32_t i=0; i<shifts[nc]; i++) ids[i] = DEF_iddata(i);
 
 	size_t here = 0;
@@ -94,163 +862,162 @@ static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
 #define WRITE(S) \
 (here += _vVvks_copy(S, &out[here], shifts[nc], ids, shifts[csind]))
 #define WRITE1(S) \
-(here += _vVvks_scan(S, &tmp[here], shifts[nc], ids, shifts[csind]))
+(here += _vVvks_scan(S, &tmp[here], shifts[nc], ids, shifts[csind], \
+	cs[csind]->unique ? shifts[csind] : shifts[nc]))
 #define RAW(...) ({ \
 	uint32_t d[] = {__VA_ARGS__}; \
 	memcpy(&out[here], d, sizeof(d)); \
 	here += sizeof(d)/sizeof(d[0]); \
 })
-#define WORD (cs[csind]->code[heres[csind]])
+#define WORD (srcs[csind][heres[csind]])
 #define OP (WORD & SpvOpCodeMask)
 #define WC (WORD >> SpvWordCountShift)
-#define OPER(N) (cs[csind]->code[heres[csind]+(N)])
+#define OPER(N) (srcs[csind][heres[csind]+(N)])
 #define NEXT (heres[csind] += WC)
 #define PASS (WRITE(&WORD), NEXT)
 #define SCAN (WRITE1(&WORD), NEXT)
-#define EOI (heres[csind] >= cs[csind]->size)
+#define GOTO(S) (heres[csind] = cs[csind]->sects[S])
+#define IN(S) (heres[csind] < cs[csind]->sects[(S)+1])
+#define SECTION(S) for(GOTO(S); IN(S);)
 
-	// First pass, map all the ids to where they belong
+	// First pass, map all the ids to where they belong. Only the imports,
+	// decorations and globals can be merged, so the rest is skipped.
 	FORCS {
-		while(!EOI) SCAN;
-		heres[csind] = 5;
+		SECTION(SECT_IMPORTS) SCAN;
+		SECTION(SECT_ANNOTATE) SCAN;
+		SECTION(SECT_TYPES) SCAN;
 	}
 	here = 0;
 
 	// Second pass, write everything out. With some extra kinks.
 
-	// Write the header, with 7 extra ids for the EP functions
-	RAW(SpvMagicNumber, SpvVersion, 0, shifts[nc]+7, 0);
+	// Write the header, with 7 extra ids for the EP functions and 7 more for
+	// their twins, if there are any
+	RAW(SpvMagicNumber, SpvVersion, 0, shifts[nc]+(twins ? 14 : 7), 0);
 
-	FORCS while(OP == SpvOpCapability) PASS;
-	FORCS while(OP == SpvOpExtension) PASS;
-	FORCS while(OP == SpvOpExtInstImport) PASS;
+	FORCS SECTION(SECT_CAPS) PASS;
+	FORCS SECTION(SECT_EXTS) PASS;
+	FORCS SECTION(SECT_IMPORTS) PASS;
 
 	// Here in the OpMemoryModel, EPs and EMs do we have to do stuff
 	// First make sure the memory models are the same:
 	{
-		uint32_t opmm[3];
-		memcpy(opmm, &cs[0]->code[heres[0]], 3*sizeof(uint32_t));
+		const uint32_t* opmm = &srcs[0][cs[0]->sects[SECT_MEMMODEL]];
 		FORCS {
-			if(memcmp(opmm, &WORD, 3*sizeof(uint32_t)) != 0)
+			GOTO(SECT_MEMMODEL);
+			if(memcmp(opmm, &WORD, 3*sizeof(uint32_t)) != 0) {
+				free(ids);
+				free(tmp);
+				free(out);
 				return VK_ERROR_INCOMPATIBLE_DRIVER;
-			NEXT;
+			}
 		}
 		RAW(opmm[0], opmm[1], opmm[2]);
 	}
 
-	// Now choose all the EPs
+	// One bit per merged <id>, for the interfaces and the EP Functions.
+	size_t setwords = (shifts[nc]+31)/32;
+	uint32_t* inset = calloc(setwords, sizeof(uint32_t));
+	uint32_t* epset = calloc(setwords, sizeof(uint32_t));
+#define BIT(S, I) ((S)[(I)/32] & 1u<<((I)%32))
+#define SETBIT(S, I) ((S)[(I)/32] |= 1u<<((I)%32))
+
+	// Now merge the EPs that were chosen at load time
 	size_t funcs[7][nc]; // Indexed by [ExecutionModel][csind]
+	int chosen[7] = {0};
 	for(SpvExecutionModel em = 0; em < 7; em++) {
 		uint32_t istart = here;
 		uint32_t idcnt = 0;
 		RAW(SpvOpEntryPoint, em, shifts[nc]+1+em, 0x6E69616D, 0);
 		size_t epstart = here;
 		FORCS {
-			uint32_t rewind = heres[csind];
 			funcs[em][csind] = 0;
-			while(OP == SpvOpEntryPoint) {
-				if(OPER(1) == em) {
-					funcs[em][csind] = OPER(2)+shifts[csind];
-					int i = 3;
-					while(OPER(i)>>24
-						&& (OPER(i)>>16)&0xFF
-						&& (OPER(i)>>8)&0xFF
-						&& OPER(i)&0xFF) i++;
-					i++;
-					for(; i<WC; i++) {
-						uint32_t id = ids[OPER(i)+shifts[csind]].map;
-						for(size_t j=epstart; j<here; j++)
-							if(id == out[j]) {
-								id = 0;
-								break;
-							}
-						if(id) {
-							RAW(id);
-							idcnt += 1;
-						}
-					}
-					break;
+			if(!cs[csind]->eps[em]) continue;
+			chosen[em] = 1;
+			heres[csind] = cs[csind]->eps[em];
+			funcs[em][csind] = OPER(2)+shifts[csind];
+			SETBIT(epset, OPER(2)+shifts[csind]);
+			int i = 3;
+			while(OPER(i)>>24
+				&& (OPER(i)>>16)&0xFF
+				&& (OPER(i)>>8)&0xFF
+				&& OPER(i)&0xFF) i++;
+			i++;
+			for(; i<WC; i++) {
+				uint32_t id = ids[OPER(i)+shifts[csind]].map;
+				if(!BIT(inset, id)) {
+					SETBIT(inset, id);
+					RAW(id);
+					idcnt += 1;
 				}
-				NEXT;
 			}
-			heres[csind] = rewind;
 		}
-		if(idcnt > 0) out[istart] |= (idcnt+5)<<SpvWordCountShift;
+		// Clear only what was set, so this stays linear in the interfaces.
+		for(size_t j=epstart; j<here; j++) inset[out[j]/32] = 0;
+		// Even without any interface, the EP is still needed (compute).
+		if(chosen[em]) out[istart] |= (idcnt+5)<<SpvWordCountShift;
 		else here = istart;
 	}
-	FORCS while(OP == SpvOpEntryPoint) NEXT;
+	free(inset);
 
-	// Currently skip the EMs, and just assume we don't need any
-	FORCS while(OP == SpvOpExecutionMode) NEXT;
+	// Each gets a "compat_main" twin with no interface, for the EMs
+	for(SpvExecutionModel em = 0; twins && em < 7; em++)
+		if(chosen[em])
+			RAW(SpvOpEntryPoint | 6<<SpvWordCountShift, em, shifts[nc]+8+em,
+				0x706D6F63, 0x6D5F7461, 0x006E6961);
 
-	FORCS while(SEC_DEBUGA) PASS;
-	FORCS while(SEC_DEBUGB) {
-		if(OP == SpvOpName) {
-			int skip = 0;
-			for(SpvExecutionModel em = 0; em < 7; em++)
-				if(OPER(1)+shifts[csind] == funcs[em][csind]) {
-					skip = 1;
-					break;
-				}
-			if(skip) NEXT;
-			else PASS;
-		} else PASS;
-	}
-	FORCS while(SEC_ANNOTATE) PASS;
-	FORCS while(SEC_TYPES) PASS;
-	FORCS {
-		size_t rewind = 0, fstart = 0;
-		while(!EOI) {
-			if(OP == SpvOpFunction) {
-				fstart = heres[csind];
-				rewind = here;
-			} else if(OP == SpvOpLabel) break;
-			PASS;
-		}
-		if(!EOI) {
-			heres[csind] = fstart;
-			here = rewind;
+	// Then the EMs for those EPs, chosen to keep every Component happy
+	for(SpvExecutionModel em = 0; em < 7; em++) {
+		if(!chosen[em]) continue;
+		long wc = mergeModes(em, shifts[nc]+1+em, twins ? shifts[nc]+8+em : 0,
+			nc, cs, srcs, shifts, ids, &out[here]);
+		if(wc < 0) {
+			free(epset);
+			free(ids);
+			free(tmp);
+			free(out);
+			return VK_ERROR_INCOMPATIBLE_DRIVER;
 		}
+		here += wc;
 	}
-	FORCS while(!EOI) {
-		if(OP != SpvOpFunction) printf("Odd error?\n");
-		int skip = 0;
-		for(SpvExecutionModel em = 0; em < 7; em++)
-			if(OPER(2)+shifts[csind] == funcs[em][csind]) {
-				funcs[em][csind] = heres[csind];
-				skip = 1;
-			}
-		if(skip) {
-			while(OP != SpvOpFunctionEnd) NEXT;
-			NEXT;
-		} else {
-			while(OP != SpvOpFunctionEnd) PASS;
-			PASS;
-		}
+
+	FORCS SECTION(SECT_DEBUGA) PASS;
+	FORCS SECTION(SECT_DEBUGB) {
+		if(OP == SpvOpName && BIT(epset, OPER(1)+shifts[csind])) NEXT;
+		else PASS;
 	}
+	free(epset);
+#undef BIT
+#undef SETBIT
+	FORCS SECTION(SECT_ANNOTATE) PASS;
+	FORCS SECTION(SECT_TYPES) PASS;
+	FORCS SECTION(SECT_DECLS) PASS;
 
-	// At the end we put the composite EP functions. First find the void:
-	uint32_t voidid = 0;
-	for(uint32_t i=0; i<shifts[nc]; i++) {
-		if(ids[i].defined && ids[i].op
-		&& (ids[i].op[0]&SpvOpCodeMask) == SpvOpTypeVoid) {
-			voidid = i;
-			break;
-		}
+	// The EP Functions are saved for the end, everything else is copied.
+	FORCS for(size_t i=0; i < cs[csind]->funccnt; i++) {
+		funcinfo* f = &cs[csind]->funcs[i];
+		if(f->ep) continue;
+		for(heres[csind] = f->start; heres[csind] < f->end;) PASS;
 	}
-	if(!voidid) {free(tmp); free(out); return VK_ERROR_INITIALIZATION_FAILED;}
+	for(SpvExecutionModel em = 0; em < 7; em++)
+		FORCS funcs[em][csind] = cs[csind]->epfuncs[em];
 
-	// Then find the void function
-	uint32_t voidfunc = 0;
-	for(uint32_t i=0; i<shifts[nc]; i++) {
-		if(ids[i].defined && ids[i].op
-		&& ids[i].op[0] == (SpvOpTypeFunction|3<<SpvWordCountShift)
-		&& ids[i].op[2] == voidid) {
-			voidfunc = i;
+	// At the end we put the composite EP functions. For that we need the
+	// void type and void() Function type, from whoever has them.
+	uint32_t voidid = 0, voidfunc = 0;
+	FORCS {
+		if(cs[csind]->voidtype && cs[csind]->voidfunc) {
+			voidid = ids[cs[csind]->voidtype + shifts[csind]].map;
+			voidfunc = ids[cs[csind]->voidfunc + shifts[csind]].map;
 			break;
 		}
 	}
-	if(!voidfunc) {free(tmp); free(out); return VK_ERROR_INITIALIZATION_FAILED;}
+	if(!voidid || !voidfunc) {
+		free(ids);
+		free(tmp);
+		free(out);
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
 
 	// Now write out the different functions
 	uint32_t extra = out[3];
@@ -259,7 +1026,7 @@ static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
 		RAW(SpvOpFunction | 5<<SpvWordCountShift, voidid,
 			shifts[nc]+1+em, 0, voidfunc);
 		RAW(SpvOpLabel | 2<<SpvWordCountShift, ++extra);
-		uint32_t labels[nc];
+		uint32_t labels[nc+1];
 		int lind = 0;
 		FORCS {
 			if(funcs[em][csind]) {
@@ -295,23 +1062,488 @@ static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
 		RAW(SpvOpReturn | 1<<SpvWordCountShift);
 		RAW(SpvOpFunctionEnd | 1<<SpvWordCountShift);
 	}
+
+	// The twins' Functions are never run, so they do nothing
+	for(SpvExecutionModel em = 0; twins && em < 7; em++) {
+		if(!chosen[em]) continue;
+		RAW(SpvOpFunction | 5<<SpvWordCountShift, voidid,
+			shifts[nc]+8+em, 0, voidfunc);
+		RAW(SpvOpLabel | 2<<SpvWordCountShift, ++extra);
+		RAW(SpvOpReturn | 1<<SpvWordCountShift);
+		RAW(SpvOpFunctionEnd | 1<<SpvWordCountShift);
+	}
 	out[3] = extra+1;
 
-	VkResult r = vVvk_CreateShaderModule(dev, &(VkShaderModuleCreateInfo){
+	free(ids);
+	free(tmp);
+	*code = out;
+	*size = here;
+	return VK_SUCCESS;
+}
+
+// Merge the Components into one SPIR-V module. On success, *<code> is set to
+// a malloc'd buffer holding the *<size> words of the result. If <twins> is
+// set, each EP gets a "compat_" twin for the EMs the Components could also
+// run under. Packed Components are unpacked for the duration.
+static VkResult merge(size_t nc, VvVkS_Component** cs, int twins,
+	uint32_t** code, size_t* size) {
+
+	const uint32_t* srcs[nc];
+	for(size_t i=0; i<nc; i++) srcs[i] = getCode(cs[i]);
+	VkResult r = mergeCode(nc, cs, srcs, twins, code, size);
+	for(size_t i=0; i<nc; i++) dropCode(cs[i], srcs[i]);
+	return r;
+}
+
+// Everything construct does short of making the ShaderModule: merge,
+// specialize (if <si> is given) and optimize as the Bank is set to.
+static VkResult build(VvVkS_Bank* b, size_t nc, VvVkS_Component** cs,
+	const VkSpecializationInfo* si, uint32_t** code, size_t* size) {
+
+	VkResult r = merge(nc, cs, 0, code, size);
+	if(r < 0) return r;
+	if(si) *size = _vVvks_specialize(*code, *size, si);
+	*size = _vVvks_optimize(*code, *size, b->level);
+	return VK_SUCCESS;
+}
+
+// The Components are built just as construct would, so this matches what
+// ends up in the ShaderModule.
+static VvVkS_Reflection* reflectConstruct(const Vv* V, VvVkS_Bank* b,
+	size_t nc, VvVkS_Component** cs) {
+
+	uint32_t* code;
+	size_t size;
+	if(build(b, nc, cs, NULL, &code, &size) < 0) return NULL;
+	VvVkS_Reflection* r = _vVvks_reflect(code, size);
+	free(code);
+	return r;
+}
+
+static uint32_t* constructCode(const Vv* V, VvVkS_Bank* b,
+	size_t nc, VvVkS_Component** cs, const VkSpecializationInfo* si,
+	size_t* size) {
+
+	uint32_t* code;
+	if(build(b, nc, cs, si, &code, size) < 0) return NULL;
+	*size *= sizeof(uint32_t);
+	return code;
+}
+
+static void destroyCode(const Vv* V, VvVkS_Bank* b, uint32_t* code) {
+	free(code);
+}
+
+// The merged code is kept as it comes out, without specializing or
+// optimizing, so that it still has everything a later merge may need. That
+// includes "compat_" twins, so it can run under whatever all its Components
+// could. Since its already been through the scan, later merges only need to
+// check it against whatever comes before it.
+static VvVkS_Component* constructComponent(const Vv* V, VvVkS_Bank* b,
+	size_t nc, VvVkS_Component** cs) {
+
+	uint32_t* code;
+	size_t size;
+	if(merge(nc, cs, 1, &code, &size) < 0) return NULL;
+	code = realloc(code, size*sizeof(uint32_t));
+	uint64_t hash;
+	VvVkS_Component* c = reuseComponent(b, code, size*sizeof(uint32_t), &hash);
+	if(c) free(code);
+	else c = addComponent(b, code, size*sizeof(uint32_t), CODE_OWNED, hash,
+		NULL);
+	if(c) {
+		c->unique = 1;
+		for(size_t i=0; i < nc; i++)
+			if(cs[i]->path || cs[i]->derived) c->derived = 1;
+	}
+	return c;
+}
+
+static void setOptimization(const Vv* V, VvVkS_Bank* b, int level) {
+	b->level = level;
+}
+
+static void setCompression(const Vv* V, VvVkS_Bank* b, int enable) {
+	b->compress = enable;
+}
+
+static size_t getCodeSize(const Vv* V, VvVkS_Bank* b, size_t* original) {
+	size_t held = 0, orig = 0;
+	for(size_t i=0; i < b->tablesize + b->filecnt; i++) {
+		const VvVkS_Component* c = i < b->tablesize ? b->table[i]
+			: b->files[i - b->tablesize];
+		if(!c) continue;
+		orig += c->size*sizeof(uint32_t);
+		held += c->storage == CODE_PACKED ? c->packedsize
+			: c->size*sizeof(uint32_t);
+	}
+	if(original) *original = orig;
+	return held;
+}
+
+static VkResult constructSpecialized(const Vv* V, VvVkS_Bank* b,
+	VkDevice dev, size_t nc, VvVkS_Component** cs,
+	const VkSpecializationInfo* si, VkShaderModule* sm) {
+
+	uint32_t* code;
+	size_t size;
+	VkResult r = build(b, nc, cs, si, &code, &size);
+	if(r < 0) return r;
+	r = vVvk_CreateShaderModule(dev, &(VkShaderModuleCreateInfo){
 		.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-		.codeSize = here*4,
-		.pCode = out,
+		.codeSize = size*sizeof(uint32_t),
+		.pCode = code,
 	}, NULL, sm);
-	free(out);
-	free(tmp);
+	free(code);
+	return r;
+}
+
+static VkResult construct(const Vv* V, VvVkS_Bank* b, VkDevice dev,
+	size_t nc, VvVkS_Component** cs, VkShaderModule* sm) {
+
+	return constructSpecialized(V, b, dev, nc, cs, NULL, sm);
+}
+
+// The workers are only started once something needs them. Any thread may be
+// the first, so this has to be under the lock.
+static _vVpool* getPool(VvVkS_Bank* b) {
+	pthread_mutex_lock(&b->lock);
+	if(!b->pool) b->pool = _vVpoolcreate(0);
+	pthread_mutex_unlock(&b->lock);
+	return b->pool;
+}
+
+typedef struct {
+	const Vv* V;
+	VvVkS_Bank* bank;
+	VkDevice dev;
+	const size_t* ncs;
+	VvVkS_Component** const* css;
+	VkShaderModule* sms;
+	VkResult* rs;
+} batch;
+
+static void constructOne(void* vb, size_t i) {
+	batch* b = vb;
+	b->rs[i] = construct(b->V, b->bank, b->dev, b->ncs[i], b->css[i],
+		&b->sms[i]);
+	if(b->rs[i] < 0) b->sms[i] = VK_NULL_HANDLE;
+}
+
+static VkResult constructBatch(const Vv* V, VvVkS_Bank* b, VkDevice dev,
+	size_t cnt, const size_t* ncs, VvVkS_Component** const* css,
+	int threads, VkShaderModule* sms) {
+
+	// vkCreateShaderModule doesn't need the Device to be externally
+	// synchronized, so whole constructs can go out to the workers.
+	VkResult* rs = malloc(cnt*sizeof(VkResult));
+	_vVpoolfor(getPool(b), cnt, threads, constructOne, &(batch){
+		.V = V, .bank = b, .dev = dev,
+		.ncs = ncs, .css = css, .sms = sms, .rs = rs,
+	});
+
+	// Report the first failure, if there was one.
+	VkResult r = VK_SUCCESS;
+	for(size_t i=0; i < cnt; i++)
+		if(rs[i] != VK_SUCCESS && (r == VK_SUCCESS || rs[i] < 0)) {
+			r = rs[i];
+			if(r < 0) break;
+		}
+	free(rs);
 	return r;
 }
 
+static void constructLater(void* vp) {
+	VvVkS_Pending* p = vp;
+	VkShaderModule sm;
+	VkResult r = construct(p->V, p->bank, p->dev, p->nc, p->cs, &sm);
+	if(r < 0) sm = VK_NULL_HANDLE;
+
+	// <p> may be gone as soon as its marked, so grab what we need first.
+	VvVkS_Bank* b = p->bank;
+	void (*done)(void*, VkShaderModule, VkResult) = p->done;
+	void* udata = p->udata;
+	pthread_mutex_lock(&b->lock);
+	p->sm = sm;
+	p->result = r;
+	p->finished = 1;
+	pthread_cond_broadcast(&b->finished);
+	pthread_mutex_unlock(&b->lock);
+	if(done) done(udata, sm, r);
+}
+
+static VvVkS_Pending* constructAsync(const Vv* V, VvVkS_Bank* b,
+	VkDevice dev, size_t nc, VvVkS_Component** cs,
+	void (*done)(void*, VkShaderModule, VkResult), void* udata) {
+
+	VvVkS_Pending* p = malloc(sizeof(VvVkS_Pending)
+		+ nc*sizeof(VvVkS_Component*));
+	*p = (VvVkS_Pending){
+		.V = V, .bank = b, .dev = dev, .done = done, .udata = udata,
+		.finished = 0, .nc = nc,
+	};
+	memcpy(p->cs, cs, nc*sizeof(VvVkS_Component*));
+	_vVpoolsubmit(getPool(b), constructLater, p);
+	return p;
+}
+
+static VkResult finishConstruct(const Vv* V, VvVkS_Bank* b,
+	VvVkS_Pending* p, int wait, VkShaderModule* sm) {
+
+	pthread_mutex_lock(&b->lock);
+	if(!wait && !p->finished) {
+		pthread_mutex_unlock(&b->lock);
+		return VK_NOT_READY;
+	}
+	while(!p->finished) pthread_cond_wait(&b->finished, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+
+	VkResult r = p->result;
+	*sm = p->sm;
+	free(p);
+	return r;
+}
+
+// Start watching the directory <c>'s file is in, if no one is already.
+static void watchFile(VvVkS_Bank* b, VvVkS_Component* c) {
+#ifdef __linux__
+	if(c->wd >= 0) return;
+	const char* slash = strrchr(c->path, '/');
+	char* dir = slash ? strndup(c->path, slash - c->path + (slash == c->path))
+		: strdup(".");
+	for(size_t i=0; i < b->dircnt; i++)
+		if(strcmp(b->dirs[i].path, dir) == 0) {
+			c->wd = b->dirs[i].wd;
+			free(dir);
+			return;
+		}
+	// Editors tend to replace files rather than write to them, so the
+	// directory is watched instead of the file itself.
+	int wd = inotify_add_watch(b->notify, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+	if(wd < 0) {
+		free(dir);
+		return;
+	}
+	b->dirs = realloc(b->dirs, (b->dircnt+1)*sizeof(watchdir));
+	b->dirs[b->dircnt++] = (watchdir){wd, dir};
+	c->wd = wd;
+#endif
+}
+
+static VvVkS_Watch* watch(const Vv* V, VvVkS_Bank* b, VkDevice dev,
+	size_t nc, VvVkS_Component** cs,
+	void (*done)(void*, VkShaderModule, VkResult), void* udata) {
+
+	// Nothing keeps track of what those were made from, so they can't be
+	// merged again when the file changes.
+	for(size_t i=0; i<nc; i++) if(cs[i]->derived) return NULL;
+
+#ifdef __linux__
+	if(b->notify < 0) b->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	VvVkS_Watch* w = malloc(sizeof(VvVkS_Watch)
+		+ nc*sizeof(VvVkS_Component*));
+	*w = (VvVkS_Watch){
+		.prev = NULL, .next = b->watches,
+		.dev = dev, .done = done, .udata = udata, .dirty = 0, .nc = nc,
+	};
+	memcpy(w->cs, cs, nc*sizeof(VvVkS_Component*));
+	if(b->watches) b->watches->prev = w;
+	b->watches = w;
+
+	for(size_t i=0; i<nc; i++) {
+		VvVkS_Component* c = cs[i];
+		if(c->usercnt && c->users[c->usercnt-1] == w) continue;
+		if(c->usercnt == c->usercap) {
+			c->usercap = c->usercap ? 2*c->usercap : 4;
+			c->users = realloc(c->users, c->usercap*sizeof(VvVkS_Watch*));
+		}
+		c->users[c->usercnt++] = w;
+		if(c->path && b->notify >= 0) {
+			watchFile(b, c);
+			ownCode(c);
+		}
+	}
+
+	VkShaderModule sm;
+	VkResult r = construct(V, b, dev, nc, cs, &sm);
+	if(done) done(udata, r < 0 ? VK_NULL_HANDLE : sm, r);
+	return w;
+}
+
+static void unwatch(const Vv* V, VvVkS_Bank* b, VvVkS_Watch* w) {
+	for(size_t i=0; i < w->nc; i++) {
+		VvVkS_Component* c = w->cs[i];
+		for(size_t j=0; j < c->usercnt; j++)
+			if(c->users[j] == w) {
+				c->users[j] = c->users[--c->usercnt];
+				break;
+			}
+	}
+	if(w->prev) w->prev->next = w->next;
+	else b->watches = w->next;
+	if(w->next) w->next->prev = w->prev;
+	free(w);
+}
+
+// Reload <c> from its file, in place so the Watches can keep using it.
+// Returns 0 and keeps the old code if the new file is no good.
+static int reloadComponent(VvVkS_Bank* b, VvVkS_Component* c) {
+	int fd = open(c->path, O_RDONLY);
+	if(fd < 0) return 0;
+	struct stat st;
+	if(fstat(fd, &st) < 0 || st.st_size < 5*sizeof(uint32_t)) {
+		close(fd);
+		return 0;
+	}
+	// Read it rather than map it, the file may well change again.
+	uint32_t* code = malloc(st.st_size);
+	size_t got = 0;
+	while(got < st.st_size) {
+		ssize_t n = read(fd, (char*)code + got, st.st_size - got);
+		if(n <= 0) break;
+		got += n;
+	}
+	close(fd);
+	if(got < st.st_size || !checkCode(code, st.st_size)) {
+		free(code);
+		return 0;
+	}
+
+	VvVkS_Component n = *c;
+	n.size = st.st_size / sizeof(uint32_t);
+	n.code = code;
+	n.storage = CODE_OWNED;
+	n.packed = NULL;
+	n.reflection = NULL;
+	n.reflected = NULL;
+	n.unique = 0;
+	if(!indexShader(&n)) {
+		freeCode(&n);
+		freeIndex(&n);
+		return 0;
+	}
+	n.reflection = _vVvks_reflect(n.code, n.size);
+	n.hash = hashCode(n.code, n.size);
+	if(b->compress) {
+		n.packed = _vVvks_pack(n.code, n.size, &n.packedsize);
+		freeCode(&n);
+		n.code = NULL;
+		n.storage = CODE_PACKED;
+	}
+
+	// Swap in the new code. Only loads of this file share <c>, so no one
+	// else sees it change. The Reflection `reflect` gave out stays where it
+	// is, with the new one copied over it (its arrays are still in the new
+	// one, which is kept around for them).
+	*c->reflection = *n.reflection;
+	n.reflected = n.reflection;
+	n.reflection = c->reflection;
+	c->reflection = NULL;
+	freeCode(c);
+	freeIndex(c);
+	*c = n;
+	return 1;
+}
+
+typedef struct {
+	const Vv* V;
+	VvVkS_Bank* bank;
+	VvVkS_Watch** ws;
+} rebuild;
+
+static void rebuildOne(void* vr, size_t i) {
+	rebuild* r = vr;
+	VvVkS_Watch* w = r->ws[i];
+	w->result = construct(r->V, r->bank, w->dev, w->nc, w->cs, &w->sm);
+	if(w->result < 0) w->sm = VK_NULL_HANDLE;
+}
+
+static size_t pollWatches(const Vv* V, VvVkS_Bank* b, int wait) {
+#ifdef __linux__
+	if(b->notify < 0) return 0;
+	if(wait) poll(&(struct pollfd){.fd = b->notify, .events = POLLIN}, 1, -1);
+
+	// Gather up everything that changed. One save can make several events.
+	VvVkS_Component** changed = NULL;
+	size_t chcnt = 0;
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while((len = read(b->notify, buf, sizeof(buf))) > 0) {
+		for(char* at = buf; at < buf + len;) {
+			const struct inotify_event* ev = (const void*)at;
+			at += sizeof(struct inotify_event) + ev->len;
+			if(!ev->len) continue;
+			for(size_t i=0; i < b->filecnt; i++) {
+				VvVkS_Component* c = b->files[i];
+				if(c->wd != ev->wd || c->changed) continue;
+				const char* slash = strrchr(c->path, '/');
+				if(strcmp(slash ? slash+1 : c->path, ev->name) != 0) continue;
+				c->changed = 1;
+				changed = realloc(changed, (chcnt+1)*sizeof(VvVkS_Component*));
+				changed[chcnt++] = c;
+			}
+		}
+	}
+
+	// Reload them, and find every Watch that uses any of them.
+	VvVkS_Watch** dirty = NULL;
+	size_t dcnt = 0;
+	for(size_t i=0; i < chcnt; i++) {
+		VvVkS_Component* c = changed[i];
+		c->changed = 0;
+		if(!reloadComponent(b, c)) continue;
+		dirty = realloc(dirty, (dcnt+c->usercnt)*sizeof(VvVkS_Watch*));
+		for(size_t j=0; j < c->usercnt; j++)
+			if(!c->users[j]->dirty) {
+				c->users[j]->dirty = 1;
+				dirty[dcnt++] = c->users[j];
+			}
+	}
+	free(changed);
+
+	// Rebuild those on the workers, but hand them out from here.
+	if(dcnt) {
+		_vVpoolfor(getPool(b), dcnt, 0, rebuildOne, &(rebuild){
+			.V = V, .bank = b, .ws = dirty,
+		});
+	}
+	for(size_t i=0; i < dcnt; i++) {
+		dirty[i]->dirty = 0;
+		if(dirty[i]->done)
+			dirty[i]->done(dirty[i]->udata, dirty[i]->sm, dirty[i]->result);
+	}
+	free(dirty);
+	return dcnt;
+#else
+	return 0;
+#endif
+}
+
 const VvVkS libVv_vks_test = {
 	.createBank = createBank,
 	.destroyBank = destroyBank,
 	.loadShader = loadShader,
+	.borrowShader = borrowShader,
+	.loadShaderFile = loadShaderFile,
+	.unloadShader = unloadShader,
+	.setOptimization = setOptimization,
+	.setCompression = setCompression,
+	.getCodeSize = getCodeSize,
 	.construct = construct,
+	.constructBatch = constructBatch,
+	.constructSpecialized = constructSpecialized,
+	.reflect = reflect,
+	.reflectConstruct = reflectConstruct,
+	.destroyReflection = destroyReflection,
+	.constructCode = constructCode,
+	.destroyCode = destroyCode,
+	.constructComponent = constructComponent,
+	.constructAsync = constructAsync,
+	.finishConstruct = finishConstruct,
+	.watch = watch,
+	.unwatch = unwatch,
+	.pollWatches = pollWatches,
 };
 
 #endif // Vv_ENABLE_VULKAN
@@ -0,0 +1,180 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#include "workpool.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct task {
+	struct task* next;
+	void (*func)(void*);
+	void* udata;
+} task;
+
+struct _vVpool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	task* head;
+	task* tail;
+	int quit;
+	int cnt;
+	pthread_t threads[];
+};
+
+static void* worker(void* vpool) {
+	_vVpool* pool = vpool;
+	pthread_mutex_lock(&pool->lock);
+	while(1) {
+		while(!pool->head && !pool->quit)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if(!pool->head) break;	// Quitting, and nothing left to do
+
+		task* t = pool->head;
+		pool->head = t->next;
+		if(!pool->head) pool->tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		t->func(t->udata);
+		free(t);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+_vVpool* _vVpoolcreate(int threads) {
+	if(threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if(threads <= 0) threads = 1;
+	_vVpool* pool = malloc(sizeof(_vVpool) + threads*sizeof(pthread_t));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pool->head = pool->tail = NULL;
+	pool->quit = 0;
+	pool->cnt = 0;
+	for(int i=0; i < threads; i++)
+		if(pthread_create(&pool->threads[pool->cnt], NULL, worker, pool) == 0)
+			pool->cnt++;
+	return pool;
+}
+
+void _vVpooldestroy(_vVpool* pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for(int i=0; i < pool->cnt; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	// If no workers could be started, the leftovers are run here.
+	for(task* t = pool->head; t;) {
+		task* n = t->next;
+		t->func(t->udata);
+		free(t);
+		t = n;
+	}
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+int _vVpoolsize(_vVpool* pool) {
+	return pool->cnt;
+}
+
+void _vVpoolsubmit(_vVpool* pool, void (*func)(void*), void* udata) {
+	if(pool->cnt == 0) {	// No workers, so we do it ourselves.
+		func(udata);
+		return;
+	}
+	task* t = malloc(sizeof(task));
+	*t = (task){ .next = NULL, .func = func, .udata = udata };
+	pthread_mutex_lock(&pool->lock);
+	if(pool->tail) pool->tail->next = t;
+	else pool->head = t;
+	pool->tail = t;
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Shared state for a _vVpoolfor. Helpers may start after the loop is over,
+// so the last one out (caller or helper) frees it.
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	void (*func)(void*, size_t);
+	void* udata;
+	size_t cnt, next, finished;
+	int refs;
+} loop;
+
+static void unref(loop* l) {
+	pthread_mutex_lock(&l->lock);
+	int last = --l->refs == 0;
+	pthread_mutex_unlock(&l->lock);
+	if(last) {
+		pthread_cond_destroy(&l->done);
+		pthread_mutex_destroy(&l->lock);
+		free(l);
+	}
+}
+
+static void helper(void* vl) {
+	loop* l = vl;
+	pthread_mutex_lock(&l->lock);
+	while(l->next < l->cnt) {
+		size_t i = l->next++;
+		pthread_mutex_unlock(&l->lock);
+		l->func(l->udata, i);
+		pthread_mutex_lock(&l->lock);
+		if(++l->finished == l->cnt) pthread_cond_broadcast(&l->done);
+	}
+	pthread_mutex_unlock(&l->lock);
+}
+
+static void helperTask(void* vl) {
+	helper(vl);
+	unref(vl);
+}
+
+void _vVpoolfor(_vVpool* pool, size_t cnt, int width,
+	void (*func)(void*, size_t), void* udata) {
+
+	if(cnt == 0) return;
+	if(width <= 0 || width > pool->cnt) width = pool->cnt;
+	if(width > cnt) width = cnt;
+	if(width <= 1) {
+		for(size_t i=0; i < cnt; i++) func(udata, i);
+		return;
+	}
+
+	loop* l = malloc(sizeof(loop));
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->done, NULL);
+	l->func = func;
+	l->udata = udata;
+	l->cnt = cnt;
+	l->next = l->finished = 0;
+	l->refs = width;
+	for(int i=1; i < width; i++) _vVpoolsubmit(pool, helperTask, l);
+
+	// Pitch in, then wait for the stragglers.
+	helper(l);
+	pthread_mutex_lock(&l->lock);
+	while(l->finished < l->cnt) pthread_cond_wait(&l->done, &l->lock);
+	pthread_mutex_unlock(&l->lock);
+	unref(l);
+}
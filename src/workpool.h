@@ -0,0 +1,45 @@
+/**************************************************************************
+   Copyright 2016-2018 Jonathon Anderson
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+***************************************************************************/
+
+#ifndef H_workpool
+#define H_workpool
+
+#include <stddef.h>
+
+// This header defines a simple pool of worker threads, for the parts of vV
+// that have more work than a single thread should be doing.
+
+typedef struct _vVpool _vVpool;
+
+// Create a pool with <threads> workers, or one per online core if 0.
+_vVpool* _vVpoolcreate(int threads);
+
+// Finish everything that has been submitted, then tear down the pool.
+void _vVpooldestroy(_vVpool* pool);
+
+// Get the number of workers in the pool.
+int _vVpoolsize(_vVpool* pool);
+
+// Queue <func>(<udata>) to be run on one of the workers at some later time.
+void _vVpoolsubmit(_vVpool* pool, void (*func)(void*), void* udata);
+
+// Run <func>(<udata>, i) for every i in [0, <cnt>), spread across at most
+// <width> threads (0 for one per worker). The calling thread counts as one of
+// them, and this returns only after every call has returned.
+void _vVpoolfor(_vVpool* pool, size_t cnt, int width,
+	void (*func)(void*, size_t), void* udata);
+
+#endif // H_workpool
@@ -16,7 +16,7 @@ if tup.getconfig 'TUP_PLATFORM' == 'linux' then
 		elseif test 'clang --version' then HOST_CC = 'clang'
 		elseif test 'gcc --version' then HOST_CC = 'gcc'
 		elseif test 'cc --version' then HOST_CC = 'cc' end
-		if not HOST_LDLIBS then HOST_LDLIBS = '-ldl -lm' end
+		if not HOST_LDLIBS then HOST_LDLIBS = '-ldl -lm -lpthread' end
 	end
 	if not HOST_AR then
 		if test '${AR} --version' then HOST_AR = '${AR}'